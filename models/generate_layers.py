@@ -0,0 +1,49 @@
+#!/usr/bin/env python3
+# Writes layers.obj and layers.mtl: stacked screen-filling grids of
+# triangles, drawn back to front from the default camera, so every layer
+# passes the depth test and writes depth and color of the whole screen.
+# Small quads behind the front layer are optional, they are the shapes
+# hidden by the large occluders for the occlusion culling.
+# Run it from the build folder, the files are not a part of the repository
+import argparse
+import os
+
+parser = argparse.ArgumentParser(description="Generate the overdraw benchmark scene")
+parser.add_argument("--layers", type=int, default=20, help="Number of stacked layers")
+parser.add_argument("--grid", type=int, default=40, help="Quads per side of a layer")
+parser.add_argument("--hidden_shapes", type=int, default=0, help="Small quads behind the front layer")
+parser.add_argument("--output", default=".", help="Output folder, the build folder by default")
+args = parser.parse_args()
+
+with open(os.path.join(args.output, "layers.mtl"), "w") as mtl:
+    mtl.write("newmtl red\nKa 0.8 0.3 0.2\nKd 0.8 0.3 0.2\nKe 0 0 0\n")
+    mtl.write("newmtl blue\nKa 0.2 0.5 0.8\nKd 0.2 0.5 0.8\nKe 0 0 0\n")
+
+with open(os.path.join(args.output, "layers.obj"), "w") as obj:
+    obj.write("mtllib layers.mtl\n")
+    n = args.grid
+    first_vertex = 1
+    for layer in range(args.layers):
+        # From z = -2 to z = 2, the camera is at z = 5
+        z = -2.0 + 4.0 * layer / max(args.layers - 1, 1)
+        obj.write("o layer%d\nusemtl %s\n" % (layer, "red" if layer % 2 else "blue"))
+        for j in range(n + 1):
+            for i in range(n + 1):
+                obj.write("v %f %f %f\n" % (-8.0 + 16.0 * i / n, -4.0 + 10.0 * j / n, z))
+        for j in range(n):
+            for i in range(n):
+                a = first_vertex + j * (n + 1) + i
+                b = a + n + 1
+                obj.write("f %d %d %d\nf %d %d %d\n" % (a, a + 1, b + 1, a, b + 1, b))
+        first_vertex += (n + 1) ** 2
+    for shape in range(args.hidden_shapes):
+        # Rows of 10 quads between the layers, inside the view of the camera
+        x = -1.5 + 3.0 * (shape % 10) / 9.0
+        y = 1.8 * (shape // 10 % 10) / 9.0
+        z = -2.0 + 4.0 * (shape % max(args.layers - 1, 1) + 0.5) / max(args.layers - 1, 1)
+        obj.write("o hidden%d\nusemtl red\n" % shape)
+        for corner in ((0.0, 0.0), (0.2, 0.0), (0.2, 0.2), (0.0, 0.2)):
+            obj.write("v %f %f %f\n" % (x + corner[0], y + corner[1], z))
+        obj.write("f %d %d %d\nf %d %d %d\n" % (
+            first_vertex, first_vertex + 1, first_vertex + 2, first_vertex, first_vertex + 2, first_vertex + 3))
+        first_vertex += 4
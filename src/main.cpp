@@ -12,7 +12,10 @@ int main(int argc, char** argv)
 
 		renderer->init();
 
-		renderer->render();
+		for (unsigned frame = 0; frame < settings->frames; ++frame) {
+			renderer->update();
+			renderer->render();
+		}
 
 		renderer->destroy();
 	}
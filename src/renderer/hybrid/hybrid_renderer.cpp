@@ -0,0 +1,134 @@
+#include "hybrid_renderer.h"
+
+#include <chrono>
+#include <cstddef>
+#include <iostream>
+
+
+void cg::renderer::hybrid_renderer::init()
+{
+	// Model, camera, acceleration structures and lights of the raytracer
+	ray_tracing_renderer::init();
+
+	gbuffer = std::make_shared<resource<gbuffer_texel>>(settings->width, settings->height);
+	depth_buffer = std::make_shared<resource<float>>(settings->width, settings->height);
+	history = std::make_shared<resource<float3>>(settings->width, settings->height);
+
+	rasterizer = std::make_shared<cg::renderer::rasterizer<
+			cg::vertex, gbuffer_texel, transform_vertex_shader, gbuffer_pixel_shader>>();
+	rasterizer->set_render_target(gbuffer, depth_buffer);
+	rasterizer->set_viewport(settings->width, settings->height);
+	// Rays hit both sides of the triangles
+	rasterizer->set_cull_mode(cull_mode::none);
+	rasterizer->set_tile_buffers(settings->tile_buffers);
+	rasterizer->set_varyings({
+			offsetof(cg::vertex, x), offsetof(cg::vertex, y), offsetof(cg::vertex, z),
+			offsetof(cg::vertex, nx), offsetof(cg::vertex, ny), offsetof(cg::vertex, nz)});
+
+	// The vertices are in world space for the raytracer
+	rasterizer->vertex_shader.world = float4x4{
+			{1.f, 0.f, 0.f, 0.f},
+			{0.f, 1.f, 0.f, 0.f},
+			{0.f, 0.f, 1.f, 0.f},
+			{0.f, 0.f, 0.f, 1.f}};
+}
+
+float4x4 cg::renderer::hybrid_renderer::get_primary_ray_matrix(float2 jitter) const
+{
+	// The primary ray of the pixel (x, y) goes along direction + u * right - v * up,
+	// where u and v map the jittered pixel to [-1, 1] as in ray_generation.
+	// Coordinates in the basis of right, up and direction are the inverse
+	// of the basis, the rows of which are the cross products of its columns
+	float3 position = camera->get_position();
+	float3 direction = camera->get_direction();
+	float3 right = camera->get_right();
+	float3 up = camera->get_up();
+	float determinant = dot(right, cross(up, direction));
+	float3 row_x = cross(up, direction) / determinant;
+	float3 row_y = cross(direction, right) / determinant;
+	float3 row_z = -cross(right, up) / determinant;
+	float4x4 view{
+			{row_x.x, row_y.x, row_z.x, 0.f},
+			{row_x.y, row_y.y, row_z.y, 0.f},
+			{row_x.z, row_y.z, row_z.z, 0.f},
+			{-dot(row_x, position), -dot(row_y, position), -dot(row_z, position), 1.f}};
+
+	// The rasterizer samples the pixel (x, y) at (x + 0.5, y + 0.5), the
+	// scale and the offset put the jittered ray of the pixel there
+	float width = static_cast<float>(settings->width);
+	float height = static_cast<float>(settings->height);
+	float aspect_ratio = width / height;
+	float scale_x = (width - 1.f) / (aspect_ratio * width);
+	float scale_y = (height - 1.f) / height;
+	float offset_x = -jitter.x / width;
+	float offset_y = jitter.y / height;
+	float z_near = settings->camera_z_near;
+	float z_far = settings->camera_z_far;
+	float4x4 projection{
+			{scale_x, 0.f, 0.f, 0.f},
+			{0.f, scale_y, 0.f, 0.f},
+			{-offset_x, -offset_y, z_far / (z_near - z_far), -1.f},
+			{0.f, 0.f, (z_far * z_near) / (z_near - z_far), 0.f}};
+
+	return mul(projection, view);
+}
+
+void cg::renderer::hybrid_renderer::rasterize_gbuffer(float2 jitter)
+{
+	rasterizer->vertex_shader.matrix = get_primary_ray_matrix(jitter);
+	rasterizer->clear_render_target(gbuffer_texel{});
+	for (size_t shape_id = 0; shape_id < model->get_index_buffers().size(); ++shape_id) {
+		const auto& index_buffer = model->get_index_buffers()[shape_id];
+		rasterizer->set_vertex_buffer(model->get_vertex_buffers()[shape_id]);
+		rasterizer->set_index_buffer(index_buffer);
+		rasterizer->draw(index_buffer->get_number_of_elements(), 0);
+	}
+	rasterizer->resolve_clears();
+}
+
+void cg::renderer::hybrid_renderer::render()
+{
+	build_light_sampler();
+	bind_shaders();
+
+	auto start = std::chrono::high_resolution_clock::now();
+
+	float3 position = camera->get_position();
+	float3 direction = camera->get_direction();
+	float3 right = camera->get_right();
+	float3 up = camera->get_up();
+	size_t depth = settings->raytracing_depth;
+	size_t accumulation_num = settings->accumulation_num;
+	history->fill(float3{0.f, 0.f, 0.f}, 0, history->get_number_of_elements());
+
+	for (size_t frame_id = 0; frame_id < accumulation_num; ++frame_id) {
+		auto jitter = raytracer->get_jitter(static_cast<int>(frame_id));
+		float frame_weight = 1.f / float(accumulation_num);
+		if (depth > 0) {
+			rasterize_gbuffer(jitter);
+		}
+
+		for (size_t y = 0; y < settings->height; ++y) {
+			for (size_t x = 0; x < settings->width; ++x) {
+				float u = (2.f * x + jitter.x) / (settings->width - 1.f) - 1.f;
+				float v = (2.f * y + jitter.y) / (settings->height - 1.f) - 1.f;
+				u *= float(settings->width) / float(settings->height);
+				ray r{position, direction + u * right - v * up};
+
+				// The G-buffer takes the place of the closest hit of the primary ray
+				const gbuffer_texel& texel = gbuffer->item(x, y);
+				cg::color color = depth > 0 && texel.is_hit ?
+										  shade_surface(r, texel.position, normalize(texel.normal), texel.diffuse, texel.emissive, depth - 1) :
+										  raytracer->miss_shader(r).color;
+
+				auto& history_pixel = history->item(x, y);
+				history_pixel += color.to_float3() * frame_weight;
+				render_target->item(x, y) = cg::unsigned_color::from_float3(history_pixel);
+			}
+		}
+	}
+
+	auto stop = std::chrono::high_resolution_clock::now();
+	std::chrono::duration<float, std::milli> duration = stop - start;
+	std::cout << duration.count() << " ms" << std::endl;
+}
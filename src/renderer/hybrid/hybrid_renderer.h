@@ -0,0 +1,61 @@
+#include "renderer/rasterizer/rasterizer_renderer.h"
+#include "renderer/raytracer/raytracer_renderer.h"
+#include "resource.h"
+
+
+namespace cg::renderer
+{
+	// Surface seen by a pixel: the world position, the interpolated normal
+	// and the material of the triangle
+	struct gbuffer_texel
+	{
+		float3 position;
+		float3 normal;
+		float3 diffuse;
+		float3 emissive;
+		bool is_hit = false;
+
+		// The rasterizer converts the pixel shader output to the target
+		static gbuffer_texel from_color(const gbuffer_texel& texel)
+		{
+			return texel;
+		}
+	};
+
+	struct gbuffer_pixel_shader
+	{
+		gbuffer_texel operator()(const cg::vertex& vertex_data, const float z) const
+		{
+			return gbuffer_texel{
+					float3{vertex_data.x, vertex_data.y, vertex_data.z},
+					float3{vertex_data.nx, vertex_data.ny, vertex_data.nz},
+					float3{vertex_data.diffuse_r, vertex_data.diffuse_g, vertex_data.diffuse_b},
+					float3{vertex_data.emissive_r, vertex_data.emissive_g, vertex_data.emissive_b},
+					true};
+		}
+	};
+
+	// Rasterizes the primary visibility into a G-buffer and traces only the
+	// secondary rays from it: the shadow rays of the next event estimation
+	// and the bounces of path tracing. The rasterizer projects through the
+	// primary rays of the raytracer, so the pixels see the same surfaces and
+	// are shaded by the same shade_surface
+	class hybrid_renderer : public ray_tracing_renderer
+	{
+	public:
+		virtual void init();
+		virtual void render();
+
+	protected:
+		std::shared_ptr<cg::resource<gbuffer_texel>> gbuffer;
+		std::shared_ptr<cg::resource<float>> depth_buffer;
+		std::shared_ptr<cg::resource<float3>> history;
+
+		std::shared_ptr<cg::renderer::rasterizer<
+				cg::vertex, gbuffer_texel, transform_vertex_shader, gbuffer_pixel_shader>>
+				rasterizer;
+
+		float4x4 get_primary_ray_matrix(float2 jitter) const;
+		void rasterize_gbuffer(float2 jitter);
+	};
+}// namespace cg::renderer
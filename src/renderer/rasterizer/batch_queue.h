@@ -0,0 +1,100 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <thread>
+
+
+namespace cg::renderer
+{
+	// Bounded ring of batches from one producer to a fixed number of
+	// consumers which all read every batch in order. A slot is reused
+	// after every consumer released it. The counters are the only
+	// synchronization, a full or an empty ring is waited on by yielding
+	template<typename T>
+	class batch_queue
+	{
+	public:
+		batch_queue(size_t in_capacity, size_t in_num_consumers);
+
+		// Producer: the slot of the next batch, once it is released by all
+		// consumers. push publishes it
+		T& acquire_slot();
+		void push();
+
+		// Consumers: the batch with the index, null until it is pushed
+		T* peek(size_t index);
+		void release(size_t index);
+
+		// Every pushed batch was released by every consumer
+		bool is_drained() const;
+		size_t get_num_consumers() const;
+
+	private:
+		// Counters of different threads on their own cache lines
+		struct slot
+		{
+			T value;
+			alignas(64) std::atomic<size_t> readers{0};
+		};
+		std::unique_ptr<slot[]> slots;
+		size_t capacity;
+		size_t num_consumers;
+		alignas(64) std::atomic<size_t> pushed{0};
+		alignas(64) std::atomic<size_t> released{0};
+	};
+
+	template<typename T>
+	inline batch_queue<T>::batch_queue(size_t in_capacity, size_t in_num_consumers)
+		: slots(new slot[in_capacity]), capacity(in_capacity), num_consumers(in_num_consumers)
+	{}
+
+	template<typename T>
+	inline T& batch_queue<T>::acquire_slot()
+	{
+		slot& next = slots[pushed.load(std::memory_order_relaxed) % capacity];
+		while (next.readers.load(std::memory_order_acquire) != 0) {
+			std::this_thread::yield();
+		}
+		return next.value;
+	}
+
+	template<typename T>
+	inline void batch_queue<T>::push()
+	{
+		size_t index = pushed.load(std::memory_order_relaxed);
+		slots[index % capacity].readers.store(num_consumers, std::memory_order_relaxed);
+		pushed.store(index + 1, std::memory_order_release);
+	}
+
+	template<typename T>
+	inline T* batch_queue<T>::peek(size_t index)
+	{
+		if (index >= pushed.load(std::memory_order_acquire)) {
+			return nullptr;
+		}
+		return &slots[index % capacity].value;
+	}
+
+	template<typename T>
+	inline void batch_queue<T>::release(size_t index)
+	{
+		// The last consumer makes the writes of all of them visible through
+		// the released counter
+		if (slots[index % capacity].readers.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+			released.fetch_add(1, std::memory_order_release);
+		}
+	}
+
+	template<typename T>
+	inline bool batch_queue<T>::is_drained() const
+	{
+		return released.load(std::memory_order_acquire) == pushed.load(std::memory_order_relaxed);
+	}
+
+	template<typename T>
+	inline size_t batch_queue<T>::get_num_consumers() const
+	{
+		return num_consumers;
+	}
+}// namespace cg::renderer
@@ -1,38 +1,154 @@
 #pragma once
 
+#include "renderer/rasterizer/batch_queue.h"
+#include "renderer/rasterizer/simd.h"
 #include "resource.h"
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
 #include <functional>
 #include <iostream>
+#include <limits>
 #include <linalg.h>
 #include <memory>
+#include <omp.h>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
 
 
 using namespace linalg::aliases;
 
 namespace cg::renderer
 {
-	template<typename VB, typename RT>
+	// Faces to skip: front faces are clockwise on the screen
+	enum class cull_mode
+	{
+		none,
+		back,
+		front
+	};
+
+	// Samples closer than the depth buffer pass the less test, the equal
+	// one is for a color pass after a depth pre-pass
+	enum class depth_function
+	{
+		less,
+		equal
+	};
+
+	// Side of the pixel blocks sharing one pixel_shader run
+	enum class shading_rate : unsigned char
+	{
+		rate_1x1 = 1,
+		rate_2x2 = 2,
+		rate_4x4 = 4
+	};
+
+	// Default shader types: any callable bound at run time. Functor types
+	// given as the template parameters are called directly and inlined,
+	// they have to be default constructible
+	template<typename VB>
+	using vertex_shader_function = std::function<std::pair<float4, VB>(float4 vertex, VB vertex_data)>;
+	template<typename VB>
+	using pixel_shader_function = std::function<cg::color(const VB& vertex_data, const float z)>;
+
+	template<typename VB, typename RT, typename VS = vertex_shader_function<VB>, typename PS = pixel_shader_function<VB>>
 	class rasterizer
 	{
 	public:
 		rasterizer(){};
-		~rasterizer(){};
+		~rasterizer();
+		// The render target may be null for depth-only draws without
+		// multisampling and deferred shading, e.g. of a shadow map
 		void set_render_target(
 				std::shared_ptr<resource<RT>> in_render_target,
 				std::shared_ptr<resource<float>> in_depth_buffer = nullptr);
+		// Clears are deferred: the tiles are only tagged, a draw call fills
+		// the tagged tiles it has triangles for. resolve_clears fills the
+		// rest, it has to run before the targets are read
 		void clear_render_target(
 				const RT& in_clear_value, const float in_depth = FLT_MAX);
+		void resolve_clears();
 
 		void set_vertex_buffer(std::shared_ptr<resource<VB>> in_vertex_buffer);
 		void set_index_buffer(std::shared_ptr<resource<unsigned int>> in_index_buffer);
 
 		void set_viewport(size_t in_width, size_t in_height);
+		void set_cull_mode(cull_mode in_cull_mode);
+		// Byte offsets of the float members of VB which the pixel shader
+		// gets interpolated with perspective correction, e.g.
+		// offsetof(cg::vertex, nx). The other members are the ones of the
+		// first vertex of the triangle
+		void set_varyings(std::vector<size_t> in_varyings);
+
+		// Deferred shading: draw calls store only the depth and the visible
+		// triangle of every pixel, shade_visible_pixels then runs
+		// pixel_shader once per covered pixel. Needs a depth buffer
+		void set_deferred_shading(bool in_deferred_shading);
+		void shade_visible_pixels();
+
+		void set_depth_function(depth_function in_depth_function);
+		// Depth-only draws skip the varyings and pixel_shader. With the less
+		// function and no multisampling whole spans of pixels are tested and
+		// stored at once
+		void set_depth_only(bool in_depth_only);
+
+		// 4x multisampling: coverage and depth are evaluated per sample,
+		// pixel_shader runs once per pixel and triangle at the pixel center.
+		// The samples take the place of the depth buffer until
+		// resolve_samples averages them into the render target. Deferred
+		// shading keeps one sample per pixel
+		void set_multisampling(bool in_multisampling);
+		void resolve_samples();
+
+		// Coarse shading: pixel_shader runs once per block of the shading
+		// rate, at the center of the block, and its covered pixels share
+		// the color. Coverage and depth stay per pixel. The rate applies to
+		// the next draw calls, the rate image has one entry per 8 x 8 pixels
+		// and the coarser of both rates is used
+		void set_shading_rate(shading_rate in_shading_rate);
+		void set_shading_rate_image(std::shared_ptr<resource<shading_rate>> in_shading_rate_image);
+
+		// Tile buffers: a thread rasterizes a tile into depth and color
+		// arrays of the tile size, which stay in its cache, and writes them
+		// to the targets row by row when the tile is done. Ignored with
+		// multisampling and deferred shading
+		void set_tile_buffers(bool in_tile_buffers);
+
+		// Pipelined draw calls: draw runs the vertex stage and the setup on
+		// the calling thread and queues the triangles in batches, worker
+		// threads rasterize the batches meanwhile, each of them owns a part
+		// of the tiles. Other calls wait for the queue to drain first,
+		// finish waits for it explicitly. pixel_shader may change only
+		// after finish
+		void set_pipelined(bool in_pipelined);
+		void finish() const;
+
+		// Occlusion query: false if a box, given by its 8 corners after the
+		// vertex transform, is behind the hierarchical depth of the drawn
+		// triangles everywhere on the screen or is out of the viewport
+		bool is_box_visible(const float4* corners) const;
+		// Sets the hierarchical depth to the farthest stored depths, e.g.
+		// after drawing the occluders: blocks covered by several triangles
+		// are only lowered here
+		void refresh_hierarchical_depth();
+
+		// Number of pixel_shader invocations since the last reset
+		size_t get_shaded_fragments() const;
+		void reset_shaded_fragments();
 
 		void draw(size_t num_vertexes, size_t vertex_offest);
 
-		std::function<std::pair<float4, VB>(float4 vertex, VB vertex_data)> vertex_shader;
-		std::function<cg::color(const VB& vertex_data, const float z)> pixel_shader;
+		VS vertex_shader{};
+		PS pixel_shader{};
+
+		// The screen is split into square tiles, each tile is rasterized by
+		// a single thread that owns its part of the render targets
+		static constexpr size_t tile_size = 64;
 
 	protected:
 		std::shared_ptr<cg::resource<VB>> vertex_buffer;
@@ -43,155 +159,1652 @@ namespace cg::renderer
 		size_t width = 1920;
 		size_t height = 1080;
 
-		float edge_function(float2 a, float2 b, float2 c);
-		bool depth_test(float z, size_t x, size_t y);
+		cull_mode culling = cull_mode::back;
+		std::vector<size_t> varyings;
+		bool deferred_shading = false;
+		depth_function depth_comparison = depth_function::less;
+		bool depth_only = false;
+		bool multisampling = false;
+		bool tile_buffers = false;
+		bool pipelined = false;
+		shading_rate draw_shading_rate = shading_rate::rate_1x1;
+		std::shared_ptr<resource<shading_rate>> shading_rate_image;
+		std::atomic<size_t> shaded_fragments{0};
+
+		// Vertices are snapped to a grid of 1 / 16 pixel. Triangles leaving
+		// the guard band are clipped to it, inside of it the edge functions
+		// stepped over a block fit 32 bits
+		static constexpr int subpixel_bits = 4;
+		static constexpr int64_t subpixel_scale = 1 << subpixel_bits;
+		static constexpr float guard_band = 16384.f;
+
+		// Triangles whose bounding box fits 4 x 4 pixels get their coverage
+		// at the setup and skip the block traversal
+		static constexpr int footprint_size = 4;
+
+		// Tiles which still have to be filled with the clear values
+		std::vector<unsigned char> cleared_tiles;
+		std::vector<unsigned char> binned_tiles;
+		RT clear_value{};
+		float clear_depth = FLT_MAX;
+
+		// Rotated grid of the samples around the pixel center, in 1 / 16
+		// pixel, and the farthest distance of a sample along an axis
+		static constexpr int num_samples = 4;
+		static constexpr int all_samples = (1 << num_samples) - 1;
+		static constexpr int sample_offsets[num_samples][2]{{-2, -6}, {6, -2}, {-6, 2}, {2, 6}};
+		static constexpr int sample_reach = 6;
+
+		// Samples of every pixel. A compressed pixel is covered by one
+		// triangle: its sample 0 holds the color and the depth at the center
+		// for all of them, depths 1 and 2 hold the depth gradient to expand
+		// the pixel with the exact depths of the samples
+		std::vector<RT> sample_colors;
+		std::vector<float> sample_depths;
+		std::vector<unsigned char> compressed_pixels;
+
+		// Depth and colors of the tile a thread rasterizes
+		struct tile_buffer
+		{
+			std::vector<float> depths;
+			std::vector<RT> colors;
+		};
+		std::vector<tile_buffer> thread_tile_buffers;
+
+		// Storage the triangles of a tile are rasterized to: the targets, or
+		// a tile buffer starting at the origin of the tile. Depths are null
+		// without a depth buffer
+		struct tile_targets
+		{
+			RT* colors;
+			float* depths;
+			int2 origin;
+			size_t stride;
+		};
+
+		// Vertex after the vertex shader. Clipping a triangle by the near
+		// plane and the four guard band planes leaves at most 8 vertices
+		struct clip_vertex
+		{
+			float4 position;
+			VB data;
+		};
+		static constexpr size_t max_clipped_vertices = 8;
+
+		// Triangle after the vertex shader, the viewport transform and the
+		// setup: edge functions are a * x + b * y + c in fixed point with
+		// the fill rule bias in c, depth and 1 / w are planes over pixel
+		// indices. Planes of the varyings divided by w start at the offset
+		struct screen_triangle
+		{
+			VB vertices[3];
+			int2 bounding_box_begin;
+			int2 bounding_box_end;
+			int64_t edge_a[3];
+			int64_t edge_b[3];
+			int64_t edge_c[3];
+			float3 depth;
+			float3 inverse_w;
+			size_t varying_offset;
+			// Small triangles: bit y * 4 + x of the pixels covered in the
+			// footprint at the beginning of the bounding box, 0 otherwise
+			int footprint_coverage;
+			shading_rate rate;
+		};
+
+		// Colors of the last shaded coarse blocks. A block maps to an entry
+		// by its position, blocks of the same 16 x 16 pixels do not collide
+		struct coarse_color
+		{
+			const screen_triangle* triangle;
+			int2 origin;
+			int size;
+			RT color;
+		};
+		static constexpr int coarse_cache_size = 16;
+
+		// Triangles of a contiguous part of the draw call and the lists of
+		// them per tile, filled by one thread of the binning pass
+		struct binning_context
+		{
+			std::vector<screen_triangle> triangles;
+			std::vector<float3> varying_planes;
+			std::vector<std::vector<unsigned int>> bins;
+			// Index of the first triangle in visible_triangles
+			unsigned int visible_offset = 0;
+		};
+		std::vector<binning_context> binning_contexts;
+
+		// Batches of the pipelined draw calls and the threads rasterizing
+		// them
+		static constexpr size_t pipeline_batch_size = 1024;
+		static constexpr size_t pipeline_capacity = 16;
+		std::unique_ptr<batch_queue<binning_context>> pipeline;
+		std::vector<std::thread> pipeline_workers;
+		std::atomic<bool> pipeline_stopping{false};
+
+		// Triangles of all deferred draw calls since the last shading pass
+		// and the index of the nearest one per pixel
+		static constexpr unsigned int no_triangle = ~0u;
+		std::vector<screen_triangle> visible_triangles;
+		std::vector<float3> visible_varying_planes;
+		std::vector<unsigned int> visibility_buffer;
+
+		// Vertices of the vertex buffer after the vertex shader, reused
+		// between the draw calls
+		std::vector<clip_vertex> transformed_vertices;
+
+		// Hierarchical depth: the farthest stored depth of every block of
+		// 8 x 8 pixels and of every tile. The values are conservative, they
+		// only move closer when a triangle covers a whole block
+		static constexpr int depth_block_size = 8;
+		std::vector<float> block_max_depth;
+		std::vector<float> tile_max_depth;
+
+		size_t get_tiles_x() const;
+		size_t get_tiles_y() const;
+		size_t get_depth_blocks_x() const;
+		size_t get_depth_blocks_y() const;
+
+		void reset_hierarchical_depth(float in_max_depth);
+		void update_tile_max_depth(size_t tile_x, size_t tile_y);
+		bool is_occluded(float nearest_depth, float max_depth) const;
+		bool is_multisampled() const;
+		bool is_tile_buffered() const;
+		void reset_samples();
+		bool has_samples() const;
+		// Fills the tagged tiles of the list and removes their tags
+		void fill_cleared_tiles(const std::vector<unsigned char>& tiles);
+		void fill_cleared_row(size_t tile_x, size_t y);
+
+		void start_pipeline();
+		void stop_pipeline_workers();
+		void run_pipeline_worker(size_t worker_id);
+		void reset_context(binning_context& context);
+		// Keeps the triangles of a deferred draw call until the shading pass
+		void keep_visible_triangles(binning_context& context);
+
+		void bin_triangles(binning_context& context, size_t vertex_begin, size_t vertex_end);
+		// Clips in place, returns the new number of vertices
+		size_t clip_polygon(clip_vertex* polygon, size_t num_vertices, float4 plane);
+		void setup_triangle(
+				binning_context& context, const clip_vertex& vertex_a,
+				const clip_vertex& vertex_b, const clip_vertex& vertex_c);
+		// Pixels of the footprint with a covered center, or sample
+		int get_footprint_coverage(const screen_triangle& triangle) const;
+		// Rasterizes the bins of the tile in the contexts, in their order
+		void rasterize_tile(
+				size_t tile_x, size_t tile_y, const binning_context* contexts,
+				size_t num_contexts, size_t thread_id);
+		// Returns true if the farthest depth of a block was lowered
+		bool rasterize_triangle(
+				const screen_triangle& triangle, const float3* varying_planes, const tile_targets& targets,
+				unsigned int visible_id, int2 clip_begin, int2 clip_end, size_t& shaded);
+		VB interpolate_vertex(const screen_triangle& triangle, const float3* varying_planes, float x, float y) const;
+		int get_coarse_size(const screen_triangle& triangle, int x, int y) const;
+		// Color of a covered pixel at the shading rate, shaded blocks are
+		// looked up in the cache
+		RT shade_pixel(
+				const screen_triangle& triangle, const float3* varying_planes,
+				int x, int y, float depth, coarse_color* cache, size_t& shaded);
+
+		bool depth_test(float z, float stored_z) const;
 	};
 
-	template<typename VB, typename RT>
-	inline void rasterizer<VB, RT>::set_render_target(
+	template<typename VB, typename RT, typename VS, typename PS>
+	inline rasterizer<VB, RT, VS, PS>::~rasterizer()
+	{
+		stop_pipeline_workers();
+	}
+
+	template<typename VB, typename RT, typename VS, typename PS>
+	inline void rasterizer<VB, RT, VS, PS>::set_render_target(
 			std::shared_ptr<resource<RT>> in_render_target,
 			std::shared_ptr<resource<float>> in_depth_buffer)
 	{
+		finish();
+		if (render_target != in_render_target || depth_buffer != in_depth_buffer) {
+			// Pending clears belong to the previous targets
+			resolve_clears();
+		}
 		render_target = in_render_target;
+		if (depth_buffer != in_depth_buffer) {
+			// Nothing is known about the content of another buffer
+			tile_max_depth.clear();
+		}
 		depth_buffer = in_depth_buffer;
 	}
 
-	template<typename VB, typename RT>
-	inline void rasterizer<VB, RT>::clear_render_target(
+	template<typename VB, typename RT, typename VS, typename PS>
+	inline void rasterizer<VB, RT, VS, PS>::clear_render_target(
 			const RT& in_clear_value, const float in_depth)
 	{
-		for (int i = 0; i < render_target->get_number_of_elements(); ++i) {
-			render_target->item(i) = in_clear_value;
+		finish();
+		clear_value = in_clear_value;
+		clear_depth = in_depth;
+		cleared_tiles.assign(get_tiles_x() * get_tiles_y(), 1);
+		reset_hierarchical_depth(in_depth);
+
+		if (is_multisampled()) {
+			compressed_pixels.resize(width * height);
+			sample_colors.resize(width * height * num_samples);
+			sample_depths.resize(width * height * num_samples);
+		}
+
+		visible_triangles.clear();
+		visible_varying_planes.clear();
+	}
+
+	template<typename VB, typename RT, typename VS, typename PS>
+	inline void rasterizer<VB, RT, VS, PS>::resolve_clears()
+	{
+		finish();
+		// The samples stay tagged, resolve_samples writes their clear values
+		// to the targets
+		if (cleared_tiles.size() == get_tiles_x() * get_tiles_y() && !has_samples()) {
+			fill_cleared_tiles(cleared_tiles);
+		}
+	}
+
+	template<typename VB, typename RT, typename VS, typename PS>
+	inline void rasterizer<VB, RT, VS, PS>::fill_cleared_tiles(const std::vector<unsigned char>& tiles)
+	{
+		// Threads fill whole rows, the tiles of a row are next to each other
+		// in memory while the rows of a tile are not
+		size_t tiles_x = get_tiles_x();
+#pragma omp parallel for schedule(static)
+		for (int y = 0; y < static_cast<int>(height); ++y) {
+			for (size_t tile_x = 0; tile_x < tiles_x; ++tile_x) {
+				size_t tile_id = (y / tile_size) * tiles_x + tile_x;
+				if (tiles[tile_id] && cleared_tiles[tile_id]) {
+					fill_cleared_row(tile_x, y);
+				}
+			}
+		}
+		for (size_t tile_id = 0; tile_id < tiles.size(); ++tile_id) {
+			if (tiles[tile_id]) {
+				cleared_tiles[tile_id] = 0;
+			}
 		}
+	}
 
-		for (int i = 0; i < depth_buffer->get_number_of_elements(); ++i) {
-			depth_buffer->item(i) = in_depth;
+	template<typename VB, typename RT, typename VS, typename PS>
+	inline void rasterizer<VB, RT, VS, PS>::fill_cleared_row(size_t tile_x, size_t y)
+	{
+		size_t begin = y * width + tile_x * tile_size;
+		size_t end = y * width + std::min((tile_x + 1) * tile_size, width);
+		if (has_samples()) {
+			std::fill(compressed_pixels.begin() + begin, compressed_pixels.begin() + end, 1);
+			for (size_t pixel = begin; pixel < end; ++pixel) {
+				sample_colors[pixel * num_samples] = clear_value;
+				sample_depths[pixel * num_samples] = clear_depth;
+				sample_depths[pixel * num_samples + 1] = 0.f;
+				sample_depths[pixel * num_samples + 2] = 0.f;
+			}
+		}
+		else {
+			if (render_target) {
+				render_target->fill(clear_value, begin, end);
+			}
+			if (depth_buffer) {
+				depth_buffer->fill(clear_depth, begin, end);
+			}
+		}
+		if (visibility_buffer.size() == width * height) {
+			std::fill(visibility_buffer.begin() + begin, visibility_buffer.begin() + end, no_triangle);
 		}
 	}
 
-	template<typename VB, typename RT>
-	inline void rasterizer<VB, RT>::set_vertex_buffer(
+	template<typename VB, typename RT, typename VS, typename PS>
+	inline void rasterizer<VB, RT, VS, PS>::set_vertex_buffer(
 			std::shared_ptr<resource<VB>> in_vertex_buffer)
 	{
 		vertex_buffer = in_vertex_buffer;
 	}
 
-	template<typename VB, typename RT>
-	inline void rasterizer<VB, RT>::set_index_buffer(
+	template<typename VB, typename RT, typename VS, typename PS>
+	inline void rasterizer<VB, RT, VS, PS>::set_index_buffer(
 			std::shared_ptr<resource<unsigned int>> in_index_buffer)
 	{
 		index_buffer = in_index_buffer;
 	}
 
-	template<typename VB, typename RT>
-	inline void rasterizer<VB, RT>::set_viewport(size_t in_width, size_t in_height)
+	template<typename VB, typename RT, typename VS, typename PS>
+	inline void rasterizer<VB, RT, VS, PS>::set_viewport(size_t in_width, size_t in_height)
 	{
+		finish();
 		width = in_width;
 		height = in_height;
 	}
 
-	template<typename VB, typename RT>
-	inline void rasterizer<VB, RT>::draw(size_t num_vertexes, size_t vertex_offset)
-	{
-		size_t vertex_id = vertex_offset;
-		while (vertex_id < vertex_offset + num_vertexes) {
-			std::vector<VB> vertices(3);
-			vertices[0] = vertex_buffer->item(index_buffer->item(vertex_id++));
-			vertices[1] = vertex_buffer->item(index_buffer->item(vertex_id++));
-			vertices[2] = vertex_buffer->item(index_buffer->item(vertex_id++));
-			for (auto& vertex: vertices) {
-				float4 coords {vertex.x, vertex.y, vertex.z, 1.f};
-				auto processed_vertex = vertex_shader(coords, vertex);
-
-				vertex.x = processed_vertex.first.x / processed_vertex.first.w;
-				vertex.y = processed_vertex.first.y / processed_vertex.first.w;
-				vertex.z = processed_vertex.first.z / processed_vertex.first.w;
-
-				vertex.x = (vertex.x + 1.f) * width / 2.f;
-				vertex.y = (-vertex.y + 1.f) * height / 2.f;
-			}
-
-			float2 bounding_box_begin {
-					std::clamp(
-							std::min(
-									std::min(vertices[0].x, vertices[1].x),
-									vertices[2].x
-									), 0.f, static_cast<float>(width - 1)),
-					std::clamp(
-							std::min(
-									std::min(vertices[0].y, vertices[1].y),
-									vertices[2].y
-									), 0.f, static_cast<float>(height - 1))
-			};
+	template<typename VB, typename RT, typename VS, typename PS>
+	inline void rasterizer<VB, RT, VS, PS>::set_cull_mode(cull_mode in_cull_mode)
+	{
+		culling = in_cull_mode;
+	}
+
+	template<typename VB, typename RT, typename VS, typename PS>
+	inline void rasterizer<VB, RT, VS, PS>::set_deferred_shading(bool in_deferred_shading)
+	{
+		finish();
+		deferred_shading = in_deferred_shading;
+	}
+
+	template<typename VB, typename RT, typename VS, typename PS>
+	inline void rasterizer<VB, RT, VS, PS>::set_depth_function(depth_function in_depth_function)
+	{
+		finish();
+		depth_comparison = in_depth_function;
+	}
+
+	template<typename VB, typename RT, typename VS, typename PS>
+	inline void rasterizer<VB, RT, VS, PS>::set_depth_only(bool in_depth_only)
+	{
+		finish();
+		depth_only = in_depth_only;
+	}
+
+	template<typename VB, typename RT, typename VS, typename PS>
+	inline void rasterizer<VB, RT, VS, PS>::set_multisampling(bool in_multisampling)
+	{
+		finish();
+		multisampling = in_multisampling;
+	}
+
+	template<typename VB, typename RT, typename VS, typename PS>
+	inline bool rasterizer<VB, RT, VS, PS>::is_multisampled() const
+	{
+		return multisampling && !deferred_shading;
+	}
+
+	template<typename VB, typename RT, typename VS, typename PS>
+	inline void rasterizer<VB, RT, VS, PS>::set_tile_buffers(bool in_tile_buffers)
+	{
+		finish();
+		tile_buffers = in_tile_buffers;
+	}
+
+	template<typename VB, typename RT, typename VS, typename PS>
+	inline bool rasterizer<VB, RT, VS, PS>::is_tile_buffered() const
+	{
+		return tile_buffers && !multisampling && !deferred_shading;
+	}
+
+	template<typename VB, typename RT, typename VS, typename PS>
+	inline void rasterizer<VB, RT, VS, PS>::set_shading_rate(shading_rate in_shading_rate)
+	{
+		// The triangles keep the rate of their draw call
+		draw_shading_rate = in_shading_rate;
+	}
+
+	template<typename VB, typename RT, typename VS, typename PS>
+	inline void rasterizer<VB, RT, VS, PS>::set_shading_rate_image(
+			std::shared_ptr<resource<shading_rate>> in_shading_rate_image)
+	{
+		finish();
+		shading_rate_image = in_shading_rate_image;
+	}
+
+	template<typename VB, typename RT, typename VS, typename PS>
+	inline void rasterizer<VB, RT, VS, PS>::set_pipelined(bool in_pipelined)
+	{
+		if (!in_pipelined) {
+			stop_pipeline_workers();
+		}
+		pipelined = in_pipelined;
+	}
+
+	template<typename VB, typename RT, typename VS, typename PS>
+	inline void rasterizer<VB, RT, VS, PS>::finish() const
+	{
+		while (pipeline && !pipeline->is_drained()) {
+			std::this_thread::yield();
+		}
+	}
+
+	template<typename VB, typename RT, typename VS, typename PS>
+	inline void rasterizer<VB, RT, VS, PS>::start_pipeline()
+	{
+		// The calling thread is the producer, the other ones of the OpenMP
+		// team rasterize
+		size_t num_workers = std::max(omp_get_max_threads() - 1, 1);
+		pipeline = std::make_unique<batch_queue<binning_context>>(pipeline_capacity, num_workers);
+		pipeline_stopping = false;
+		for (size_t worker_id = 0; worker_id < num_workers; ++worker_id) {
+			pipeline_workers.emplace_back(&rasterizer::run_pipeline_worker, this, worker_id);
+		}
+	}
+
+	template<typename VB, typename RT, typename VS, typename PS>
+	inline void rasterizer<VB, RT, VS, PS>::stop_pipeline_workers()
+	{
+		finish();
+		pipeline_stopping = true;
+		for (auto& worker: pipeline_workers) {
+			worker.join();
+		}
+		pipeline_workers.clear();
+		pipeline.reset();
+	}
+
+	template<typename VB, typename RT, typename VS, typename PS>
+	inline void rasterizer<VB, RT, VS, PS>::run_pipeline_worker(size_t worker_id)
+	{
+		// Tiles are dealt to the workers in turns. An idle worker yields
+		// first and sleeps after a while, e.g. between the frames
+		size_t num_workers = pipeline->get_num_consumers();
+		size_t idle_polls = 0;
+		for (size_t index = 0; !pipeline_stopping.load(std::memory_order_relaxed);) {
+			binning_context* batch = pipeline->peek(index);
+			if (!batch) {
+				if (++idle_polls < 1024) {
+					std::this_thread::yield();
+				}
+				else {
+					std::this_thread::sleep_for(std::chrono::microseconds(100));
+				}
+				continue;
+			}
+			idle_polls = 0;
+
+			size_t tiles_x = get_tiles_x();
+			for (size_t tile_id = worker_id; tile_id < batch->bins.size(); tile_id += num_workers) {
+				if (!batch->bins[tile_id].empty()) {
+					rasterize_tile(tile_id % tiles_x, tile_id / tiles_x, batch, 1, worker_id);
+				}
+			}
+			pipeline->release(index++);
+		}
+	}
+
+	template<typename VB, typename RT, typename VS, typename PS>
+	inline bool rasterizer<VB, RT, VS, PS>::has_samples() const
+	{
+		return is_multisampled() && compressed_pixels.size() == width * height;
+	}
+
+	template<typename VB, typename RT, typename VS, typename PS>
+	inline void rasterizer<VB, RT, VS, PS>::reset_samples()
+	{
+		// Every pixel starts compressed with the content of the render
+		// target and of the depth buffer
+		size_t num_pixels = width * height;
+		compressed_pixels.assign(num_pixels, 1);
+		sample_colors.resize(num_pixels * num_samples);
+		sample_depths.resize(num_pixels * num_samples);
+		for (size_t pixel = 0; pixel < num_pixels; ++pixel) {
+			sample_colors[pixel * num_samples] = render_target->item(pixel);
+			sample_depths[pixel * num_samples] = depth_buffer ? depth_buffer->item(pixel) : FLT_MAX;
+			sample_depths[pixel * num_samples + 1] = 0.f;
+			sample_depths[pixel * num_samples + 2] = 0.f;
+		}
+	}
+
+	template<typename VB, typename RT, typename VS, typename PS>
+	inline size_t rasterizer<VB, RT, VS, PS>::get_shaded_fragments() const
+	{
+		finish();
+		return shaded_fragments;
+	}
+
+	template<typename VB, typename RT, typename VS, typename PS>
+	inline void rasterizer<VB, RT, VS, PS>::reset_shaded_fragments()
+	{
+		finish();
+		shaded_fragments = 0;
+	}
+
+	template<typename VB, typename RT, typename VS, typename PS>
+	inline void rasterizer<VB, RT, VS, PS>::set_varyings(std::vector<size_t> in_varyings)
+	{
+		finish();
+		varyings = std::move(in_varyings);
+	}
+
+	template<typename VB, typename RT, typename VS, typename PS>
+	inline size_t rasterizer<VB, RT, VS, PS>::get_tiles_x() const
+	{
+		return (width + tile_size - 1) / tile_size;
+	}
+
+	template<typename VB, typename RT, typename VS, typename PS>
+	inline size_t rasterizer<VB, RT, VS, PS>::get_tiles_y() const
+	{
+		return (height + tile_size - 1) / tile_size;
+	}
+
+	template<typename VB, typename RT, typename VS, typename PS>
+	inline size_t rasterizer<VB, RT, VS, PS>::get_depth_blocks_x() const
+	{
+		return (width + depth_block_size - 1) / depth_block_size;
+	}
+
+	template<typename VB, typename RT, typename VS, typename PS>
+	inline size_t rasterizer<VB, RT, VS, PS>::get_depth_blocks_y() const
+	{
+		return (height + depth_block_size - 1) / depth_block_size;
+	}
+
+	template<typename VB, typename RT, typename VS, typename PS>
+	inline void rasterizer<VB, RT, VS, PS>::reset_hierarchical_depth(float in_max_depth)
+	{
+		block_max_depth.assign(get_depth_blocks_x() * get_depth_blocks_y(), in_max_depth);
+		tile_max_depth.assign(get_tiles_x() * get_tiles_y(), in_max_depth);
+	}
+
+	template<typename VB, typename RT, typename VS, typename PS>
+	inline void rasterizer<VB, RT, VS, PS>::update_tile_max_depth(size_t tile_x, size_t tile_y)
+	{
+		size_t blocks_x = get_depth_blocks_x();
+		size_t block_begin_x = tile_x * tile_size / depth_block_size;
+		size_t block_begin_y = tile_y * tile_size / depth_block_size;
+		size_t block_end_x = (std::min((tile_x + 1) * tile_size, width) + depth_block_size - 1) / depth_block_size;
+		size_t block_end_y = (std::min((tile_y + 1) * tile_size, height) + depth_block_size - 1) / depth_block_size;
+
+		float max_depth = -std::numeric_limits<float>::infinity();
+		for (size_t block_y = block_begin_y; block_y < block_end_y; ++block_y) {
+			for (size_t block_x = block_begin_x; block_x < block_end_x; ++block_x) {
+				max_depth = std::max(max_depth, block_max_depth[block_y * blocks_x + block_x]);
+			}
+		}
+		tile_max_depth[tile_y * get_tiles_x() + tile_x] = max_depth;
+	}
+
+	template<typename VB, typename RT, typename VS, typename PS>
+	inline bool rasterizer<VB, RT, VS, PS>::is_occluded(float nearest_depth, float max_depth) const
+	{
+		// The equal test passes the triangle which stored the farthest depth
+		if (depth_comparison == depth_function::equal) {
+			return nearest_depth > max_depth;
+		}
+		return nearest_depth >= max_depth;
+	}
+
+	template<typename VB, typename RT, typename VS, typename PS>
+	inline bool rasterizer<VB, RT, VS, PS>::is_box_visible(const float4* corners) const
+	{
+		finish();
+		if (!depth_buffer || block_max_depth.size() != get_depth_blocks_x() * get_depth_blocks_y()) {
+			return true;
+		}
+
+		// Screen rectangle and the nearest depth of the corners. A box
+		// crossing the near plane may cover anything
+		float2 screen_min{std::numeric_limits<float>::infinity(), std::numeric_limits<float>::infinity()};
+		float2 screen_max = -screen_min;
+		float nearest_depth = std::numeric_limits<float>::infinity();
+		for (size_t i = 0; i < 8; ++i) {
+			const float4& corner = corners[i];
+			if (!(corner.w > 0.f && corner.z >= 0.f) || !std::isfinite(corner.x) || !std::isfinite(corner.y)) {
+				return true;
+			}
+			float2 screen{
+					(corner.x / corner.w + 1.f) * width / 2.f,
+					(-corner.y / corner.w + 1.f) * height / 2.f};
+			screen_min = min(screen_min, screen);
+			screen_max = max(screen_max, screen);
+			nearest_depth = std::min(nearest_depth, corner.z / corner.w);
+		}
+
+		// Pixels touched by the rectangle with a margin for the samples
+		float2 first_pixel{
+				std::max(std::floor(screen_min.x) - 1.f, 0.f),
+				std::max(std::floor(screen_min.y) - 1.f, 0.f)};
+		float2 last_pixel{
+				std::min(std::ceil(screen_max.x) + 1.f, width - 1.f),
+				std::min(std::ceil(screen_max.y) + 1.f, height - 1.f)};
+		if (!(first_pixel.x <= last_pixel.x && first_pixel.y <= last_pixel.y)) {
+			return false;
+		}
+		int2 begin{static_cast<int>(first_pixel.x), static_cast<int>(first_pixel.y)};
+		int2 end{static_cast<int>(last_pixel.x), static_cast<int>(last_pixel.y)};
+
+		size_t blocks_x = get_depth_blocks_x();
+		for (int block_y = begin.y / depth_block_size; block_y <= end.y / depth_block_size; ++block_y) {
+			for (int block_x = begin.x / depth_block_size; block_x <= end.x / depth_block_size; ++block_x) {
+				if (!is_occluded(nearest_depth, block_max_depth[block_y * blocks_x + block_x])) {
+					return true;
+				}
+			}
+		}
+		return false;
+	}
+
+	template<typename VB, typename RT, typename VS, typename PS>
+	inline void rasterizer<VB, RT, VS, PS>::refresh_hierarchical_depth()
+	{
+		finish();
+		size_t tiles_x = get_tiles_x();
+		size_t num_tiles = tiles_x * get_tiles_y();
+		if (!depth_buffer || tile_max_depth.size() != num_tiles || cleared_tiles.size() != num_tiles) {
+			return;
+		}
+
+		// Tiles tagged by a clear keep the clear depth. The samples of a
+		// compressed pixel are within the reach of the gradient
+		size_t blocks_x = get_depth_blocks_x();
+		bool samples = has_samples();
+#pragma omp parallel for schedule(dynamic, 1)
+		for (int tile_id = 0; tile_id < static_cast<int>(num_tiles); ++tile_id) {
+			if (cleared_tiles[tile_id]) {
+				continue;
+			}
+			size_t tile_x = tile_id % tiles_x;
+			size_t tile_y = tile_id / tiles_x;
+			size_t end_x = std::min((tile_x + 1) * tile_size, width);
+			size_t end_y = std::min((tile_y + 1) * tile_size, height);
+			for (size_t block_y = tile_y * tile_size; block_y < end_y; block_y += depth_block_size) {
+				for (size_t block_x = tile_x * tile_size; block_x < end_x; block_x += depth_block_size) {
+					float max_depth = -std::numeric_limits<float>::infinity();
+					for (size_t y = block_y; y < std::min(block_y + depth_block_size, end_y); ++y) {
+						for (size_t x = block_x; x < std::min(block_x + depth_block_size, end_x); ++x) {
+							size_t pixel = y * width + x;
+							if (!samples) {
+								max_depth = std::max(max_depth, depth_buffer->item(pixel));
+								continue;
+							}
+							const float* depths = sample_depths.data() + pixel * num_samples;
+							if (compressed_pixels[pixel]) {
+								float reach = (std::abs(depths[1]) + std::abs(depths[2])) * sample_reach / subpixel_scale;
+								max_depth = std::max(max_depth, depths[0] + reach);
+							}
+							else {
+								max_depth = std::max(max_depth, *std::max_element(depths, depths + num_samples));
+							}
+						}
+					}
+					// The same margin as for the covered blocks
+					size_t block_id = (block_y / depth_block_size) * blocks_x + block_x / depth_block_size;
+					block_max_depth[block_id] = std::min(
+							block_max_depth[block_id], max_depth + std::abs(max_depth) * 1e-5f);
+				}
+			}
+			update_tile_max_depth(tile_x, tile_y);
+		}
+	}
+
+	template<typename VB, typename RT, typename VS, typename PS>
+	inline void rasterizer<VB, RT, VS, PS>::draw(size_t num_vertexes, size_t vertex_offset)
+	{
+		size_t num_tiles = get_tiles_x() * get_tiles_y();
+		size_t num_triangles = num_vertexes / 3;
+
+		if (depth_buffer && (tile_max_depth.size() != num_tiles ||
+							 block_max_depth.size() != get_depth_blocks_x() * get_depth_blocks_y())) {
+			// The depth buffer was not cleared by the rasterizer, any depth
+			// may be stored there
+			finish();
+			reset_hierarchical_depth(std::numeric_limits<float>::infinity());
+		}
+
+		if (cleared_tiles.size() != num_tiles) {
+			finish();
+			cleared_tiles.assign(num_tiles, 0);
+		}
+		if (is_multisampled() && compressed_pixels.size() != width * height) {
+			// The samples start from the targets with the clears applied
+			resolve_clears();
+			reset_samples();
+		}
+		if (pipelined && !pipeline) {
+			start_pipeline();
+		}
+		if (is_tile_buffered()) {
+			size_t num_threads = std::max(static_cast<size_t>(omp_get_max_threads()), pipeline_workers.size());
+			if (thread_tile_buffers.size() < num_threads) {
+				finish();
+				thread_tile_buffers.resize(num_threads);
+			}
+			for (auto& buffer: thread_tile_buffers) {
+				buffer.depths.resize(tile_size * tile_size);
+				buffer.colors.resize(tile_size * tile_size);
+			}
+		}
+
+		// Vertex stage: every vertex of the buffer is transformed once, the
+		// triangles sharing it read the result by index. A vertex shader
+		// with a batched form transforms simd::lanes vertices per call and
+		// the rest of the buffer one by one. The pipelined draw calls leave
+		// the other threads to the rasterization
+		int num_buffer_vertices = static_cast<int>(vertex_buffer->get_number_of_elements());
+		transformed_vertices.resize(num_buffer_vertices);
+		auto transform_vertex = [&](int vertex_id) {
+			const VB& vertex = vertex_buffer->item(vertex_id);
+			auto processed_vertex = vertex_shader(float4{vertex.x, vertex.y, vertex.z, 1.f}, vertex);
+			transformed_vertices[vertex_id] = clip_vertex{processed_vertex.first, processed_vertex.second};
+		};
+		if constexpr (std::is_invocable_v<const VS&, const VB*, std::pair<float4, VB>*>) {
+			int num_batches = num_buffer_vertices / simd::lanes;
+#pragma omp parallel for schedule(static) if (!pipelined)
+			for (int batch_id = 0; batch_id < num_batches; ++batch_id) {
+				int first_vertex = batch_id * simd::lanes;
+				std::pair<float4, VB> processed_vertices[simd::lanes];
+				vertex_shader(&vertex_buffer->item(first_vertex), processed_vertices);
+				for (int lane = 0; lane < simd::lanes; ++lane) {
+					transformed_vertices[first_vertex + lane] =
+							clip_vertex{processed_vertices[lane].first, processed_vertices[lane].second};
+				}
+			}
+			for (int vertex_id = num_batches * simd::lanes; vertex_id < num_buffer_vertices; ++vertex_id) {
+				transform_vertex(vertex_id);
+			}
+		}
+		else {
+#pragma omp parallel for schedule(static) if (!pipelined)
+			for (int vertex_id = 0; vertex_id < num_buffer_vertices; ++vertex_id) {
+				transform_vertex(vertex_id);
+			}
+		}
 
-			float2 bounding_box_end {
-					std::clamp(
-							std::max(
-									std::max(vertices[0].x, vertices[1].x),
-									vertices[2].x
-									), 0.f, static_cast<float>(width - 1)),
-					std::clamp(
-							std::max(
-									std::max(vertices[0].y, vertices[1].y),
-									vertices[2].y
-									), 0.f, static_cast<float>(height - 1))
+		if (pipelined) {
+			// The batches are set up in order and queued as soon as they are
+			// binned, the workers fill the tagged tiles they rasterize
+			for (size_t triangle_begin = 0; triangle_begin < num_triangles; triangle_begin += pipeline_batch_size) {
+				size_t triangle_end = std::min(triangle_begin + pipeline_batch_size, num_triangles);
+				binning_context& batch = pipeline->acquire_slot();
+				reset_context(batch);
+				bin_triangles(batch, vertex_offset + triangle_begin * 3, vertex_offset + triangle_end * 3);
+				if (batch.triangles.empty()) {
+					continue;
+				}
+				if (deferred_shading && !depth_only) {
+					keep_visible_triangles(batch);
+				}
+				pipeline->push();
+			}
+			return;
+		}
+
+		binning_contexts.resize(std::max(binning_contexts.size(), static_cast<size_t>(omp_get_max_threads())));
+		for (auto& context: binning_contexts) {
+			reset_context(context);
+		}
+
+		// Sort-middle, pass 1: every thread assembles, clips and sets up a
+		// contiguous range of triangles and bins them into the tiles they overlap
+#pragma omp parallel num_threads(static_cast<int>(binning_contexts.size()))
+		{
+			size_t thread_id = omp_get_thread_num();
+			size_t num_threads = omp_get_num_threads();
+			size_t triangle_begin = num_triangles * thread_id / num_threads;
+			size_t triangle_end = num_triangles * (thread_id + 1) / num_threads;
+
+			bin_triangles(
+					binning_contexts[thread_id],
+					vertex_offset + triangle_begin * 3,
+					vertex_offset + triangle_end * 3);
+		}
+
+		if (deferred_shading && !depth_only) {
+			for (auto& context: binning_contexts) {
+				keep_visible_triangles(context);
+			}
+		}
+
+		// Tagged tiles get the clear values before the first triangle is
+		// rasterized in them, the tile buffers start from the clear values
+		bool has_cleared_tiles = false;
+		binned_tiles.assign(num_tiles, 0);
+		for (size_t tile_id = 0; tile_id < num_tiles; ++tile_id) {
+			for (const auto& context: binning_contexts) {
+				binned_tiles[tile_id] |= !context.bins[tile_id].empty();
+			}
+			has_cleared_tiles |= binned_tiles[tile_id] && cleared_tiles[tile_id];
+		}
+		if (has_cleared_tiles && !is_tile_buffered()) {
+			fill_cleared_tiles(binned_tiles);
+		}
+
+		// Pass 2: every tile is rasterized by one thread. Bins of the
+		// contexts are visited in order, which keeps the submission order
+		int tiles_x = static_cast<int>(get_tiles_x());
+#pragma omp parallel for schedule(dynamic, 1)
+		for (int tile_id = 0; tile_id < static_cast<int>(num_tiles); ++tile_id) {
+			if (binned_tiles[tile_id]) {
+				rasterize_tile(
+						tile_id % tiles_x, tile_id / tiles_x, binning_contexts.data(),
+						binning_contexts.size(), omp_get_thread_num());
+			}
+		}
+	}
+
+	template<typename VB, typename RT, typename VS, typename PS>
+	inline void rasterizer<VB, RT, VS, PS>::reset_context(binning_context& context)
+	{
+		context.triangles.clear();
+		context.varying_planes.clear();
+		context.bins.resize(get_tiles_x() * get_tiles_y());
+		for (auto& bin: context.bins) {
+			bin.clear();
+		}
+	}
+
+	template<typename VB, typename RT, typename VS, typename PS>
+	inline void rasterizer<VB, RT, VS, PS>::keep_visible_triangles(binning_context& context)
+	{
+		if (visibility_buffer.size() != width * height) {
+			finish();
+			visibility_buffer.assign(width * height, no_triangle);
+		}
+		context.visible_offset = static_cast<unsigned int>(visible_triangles.size());
+		size_t varying_offset = visible_varying_planes.size();
+		for (const screen_triangle& triangle: context.triangles) {
+			visible_triangles.push_back(triangle);
+			visible_triangles.back().varying_offset += varying_offset;
+		}
+		visible_varying_planes.insert(
+				visible_varying_planes.end(), context.varying_planes.begin(), context.varying_planes.end());
+	}
+
+	template<typename VB, typename RT, typename VS, typename PS>
+	inline void rasterizer<VB, RT, VS, PS>::bin_triangles(
+			binning_context& context, size_t vertex_begin, size_t vertex_end)
+	{
+		// Guard band in normalized device coordinates
+		float guard_band_x = 2.f * guard_band / width - 1.f;
+		float guard_band_y = 2.f * guard_band / height - 1.f;
+		const float4 near_plane{0.f, 0.f, 1.f, 0.f};
+		const float4 guard_band_planes[4]{
+				{-1.f, 0.f, 0.f, guard_band_x},
+				{1.f, 0.f, 0.f, guard_band_x},
+				{0.f, -1.f, 0.f, guard_band_y},
+				{0.f, 1.f, 0.f, guard_band_y}};
+
+		for (size_t vertex_id = vertex_begin; vertex_id < vertex_end; vertex_id += 3) {
+			clip_vertex polygon[max_clipped_vertices];
+			for (size_t i = 0; i < 3; ++i) {
+				polygon[i] = transformed_vertices[index_buffer->item(vertex_id + i)];
+			}
+
+			// Trivial reject: all vertices are outside of one frustum plane
+			int outcodes[3];
+			for (size_t i = 0; i < 3; ++i) {
+				const float4& position = polygon[i].position;
+				outcodes[i] = (position.x < -position.w) | (position.x > position.w) << 1 |
+							  (position.y < -position.w) << 2 | (position.y > position.w) << 3 |
+							  (position.z < 0.f) << 4 | (position.z > position.w) << 5;
+			}
+			if (outcodes[0] & outcodes[1] & outcodes[2]) {
+				continue;
+			}
+
+			// Only triangles crossing the near plane are clipped, the other
+			// planes are handled by the guard band and the scissoring to
+			// the viewport, until a vertex leaves the guard band
+			size_t num_vertices = 3;
+			if ((outcodes[0] | outcodes[1] | outcodes[2]) & 1 << 4) {
+				num_vertices = clip_polygon(polygon, num_vertices, near_plane);
+			}
+			bool exceeds_guard_band = false;
+			for (size_t i = 0; i < num_vertices; ++i) {
+				const float4& position = polygon[i].position;
+				exceeds_guard_band |= std::abs(position.x) > guard_band_x * position.w ||
+									  std::abs(position.y) > guard_band_y * position.w;
+			}
+			if (exceeds_guard_band) {
+				for (const float4& plane: guard_band_planes) {
+					num_vertices = clip_polygon(polygon, num_vertices, plane);
+				}
+			}
+
+			for (size_t i = 2; i < num_vertices; ++i) {
+				setup_triangle(context, polygon[0], polygon[i - 1], polygon[i]);
+			}
+		}
+	}
+
+	template<typename VB, typename RT, typename VS, typename PS>
+	inline size_t rasterizer<VB, RT, VS, PS>::clip_polygon(
+			clip_vertex* polygon, size_t num_vertices, float4 plane)
+	{
+		// Sutherland-Hodgman against the half-space dot(plane, position) >= 0
+		clip_vertex clipped[max_clipped_vertices];
+		size_t num_clipped = 0;
+		for (size_t i = 0; i < num_vertices; ++i) {
+			const clip_vertex& current = polygon[i];
+			const clip_vertex& next = polygon[(i + 1) % num_vertices];
+			float current_distance = dot(plane, current.position);
+			float next_distance = dot(plane, next.position);
+
+			// Rounding may make a nearly degenerate polygon concave, the
+			// vertices that do not fit are dropped
+			if (current_distance >= 0.f && num_clipped < max_clipped_vertices) {
+				clipped[num_clipped++] = current;
+			}
+			if ((current_distance >= 0.f) != (next_distance >= 0.f) && num_clipped < max_clipped_vertices) {
+				float t = current_distance / (current_distance - next_distance);
+				clipped[num_clipped++] = clip_vertex{
+						current.position + (next.position - current.position) * t,
+						current.data * (1.f - t) + next.data * t};
+			}
+		}
+		std::copy(clipped, clipped + num_clipped, polygon);
+		return num_clipped;
+	}
+
+	template<typename VB, typename RT, typename VS, typename PS>
+	inline void rasterizer<VB, RT, VS, PS>::setup_triangle(
+			binning_context& context, const clip_vertex& vertex_a,
+			const clip_vertex& vertex_b, const clip_vertex& vertex_c)
+	{
+		size_t tiles_x = get_tiles_x();
+
+		screen_triangle triangle;
+		const clip_vertex* clip_vertices[3]{&vertex_a, &vertex_b, &vertex_c};
+		for (size_t i = 0; i < 3; ++i) {
+			const float4& position = clip_vertices[i]->position;
+			VB vertex = clip_vertices[i]->data;
+			vertex.x = position.x / position.w;
+			vertex.y = position.y / position.w;
+			vertex.z = position.z / position.w;
+
+			vertex.x = (vertex.x + 1.f) * width / 2.f;
+			vertex.y = (-vertex.y + 1.f) * height / 2.f;
+			triangle.vertices[i] = vertex;
+		}
+
+		// Snap to the subpixel grid
+		VB* vertices = triangle.vertices;
+		int64_t x[3];
+		int64_t y[3];
+		for (size_t i = 0; i < 3; ++i) {
+			if (!std::isfinite(vertices[i].x) || !std::isfinite(vertices[i].y) || !std::isfinite(vertices[i].z)) {
+				return;
+			}
+			x[i] = std::llround(vertices[i].x * subpixel_scale);
+			y[i] = std::llround(vertices[i].y * subpixel_scale);
+		}
+
+		// Doubled area, positive for the front faces which are clockwise on
+		// the screen
+		int64_t area = (y[1] - y[0]) * (x[2] - x[0]) - (x[1] - x[0]) * (y[2] - y[0]);
+		if (area == 0 ||
+			(area < 0 && culling == cull_mode::back) ||
+			(area > 0 && culling == cull_mode::front)) {
+			return;
+		}
+		if (area < 0) {
+			// Visible back face: the reversed order makes it a front one
+			std::swap(vertices[1], vertices[2]);
+			std::swap(clip_vertices[1], clip_vertices[2]);
+			std::swap(x[1], x[2]);
+			std::swap(y[1], y[2]);
+			area = -area;
+		}
+
+		// Pixels whose centers, or samples, are inside of the bounding box
+		int64_t reach = is_multisampled() ? sample_reach : 0;
+		auto first_pixel = [&](int64_t coordinate) {
+			coordinate -= reach;
+			return static_cast<int>(std::ceil((coordinate - subpixel_scale / 2) / static_cast<double>(subpixel_scale)));
+		};
+		auto last_pixel = [&](int64_t coordinate) {
+			coordinate += reach;
+			return static_cast<int>(std::floor((coordinate - subpixel_scale / 2) / static_cast<double>(subpixel_scale)));
+		};
+		triangle.bounding_box_begin = int2{
+				std::max(first_pixel(std::min({x[0], x[1], x[2]})), 0),
+				std::max(first_pixel(std::min({y[0], y[1], y[2]})), 0)};
+		triangle.bounding_box_end = int2{
+				std::min(last_pixel(std::max({x[0], x[1], x[2]})), static_cast<int>(width) - 1),
+				std::min(last_pixel(std::max({y[0], y[1], y[2]})), static_cast<int>(height) - 1)};
+		if (triangle.bounding_box_begin.x > triangle.bounding_box_end.x ||
+			triangle.bounding_box_begin.y > triangle.bounding_box_end.y) {
+			return;
+		}
+
+		// Setup: edge i goes from vertex i to vertex i + 1, its value is
+		// the weight of the opposite vertex scaled by the doubled area
+		for (size_t i = 0; i < 3; ++i) {
+			size_t next = (i + 1) % 3;
+			triangle.edge_a[i] = y[next] - y[i];
+			triangle.edge_b[i] = x[i] - x[next];
+			triangle.edge_c[i] = -triangle.edge_a[i] * x[i] - triangle.edge_b[i] * y[i];
+		}
+
+		// Top-left rule: samples exactly on an edge belong to the triangle
+		// only if the edge is a left or a top one, so shared edges are
+		// rasterized once
+		for (size_t i = 0; i < 3; ++i) {
+			bool is_left = triangle.edge_a[i] > 0;
+			bool is_top = triangle.edge_a[i] == 0 && triangle.edge_b[i] > 0;
+			if (!is_left && !is_top) {
+				triangle.edge_c[i] -= 1;
+			}
+		}
+
+		// Small triangles: the footprint is tested at once, the ones covering
+		// no pixel centers, or no samples, are culled before the planes
+		triangle.footprint_coverage = 0;
+		triangle.rate = draw_shading_rate;
+		int2 bounding_box_size = triangle.bounding_box_end - triangle.bounding_box_begin + 1;
+		bool is_small = std::max({x[0], x[1], x[2]}) - std::min({x[0], x[1], x[2]}) <= footprint_size * subpixel_scale &&
+						std::max({y[0], y[1], y[2]}) - std::min({y[0], y[1], y[2]}) <= footprint_size * subpixel_scale;
+		if (is_small && bounding_box_size.x <= footprint_size && bounding_box_size.y <= footprint_size) {
+			int coverage = get_footprint_coverage(triangle);
+			// Pixels out of the bounding box may be covered past the screen
+			int inside_mask = 0;
+			for (int y = 0; y < bounding_box_size.y; ++y) {
+				inside_mask |= ((1 << bounding_box_size.x) - 1) << (y * footprint_size);
+			}
+			coverage &= inside_mask;
+			if (!coverage) {
+				return;
+			}
+			if (!is_multisampled()) {
+				triangle.footprint_coverage = coverage;
+			}
+		}
+
+		// Planes over pixel indices, sampled at pixel centers
+		float3 edge_planes[3];
+		float float_x[3];
+		float float_y[3];
+		for (size_t i = 0; i < 3; ++i) {
+			float_x[i] = static_cast<float>(x[i]) / subpixel_scale;
+			float_y[i] = static_cast<float>(y[i]) / subpixel_scale;
+		}
+		float inverse_area = (subpixel_scale * subpixel_scale) / static_cast<float>(area);
+		for (size_t i = 0; i < 3; ++i) {
+			size_t next = (i + 1) % 3;
+			float a = float_y[next] - float_y[i];
+			float b = float_x[i] - float_x[next];
+			float c = -a * float_x[i] - b * float_y[i];
+			edge_planes[i] = float3{a, b, c} * inverse_area;
+		}
+		auto make_plane = [&](float value_0, float value_1, float value_2) {
+			float3 plane = edge_planes[1] * value_0 + edge_planes[2] * value_1 + edge_planes[0] * value_2;
+			return float3{plane.x, plane.y, plane.z + (plane.x + plane.y) / 2.f};
+		};
+		triangle.depth = make_plane(vertices[0].z, vertices[1].z, vertices[2].z);
+
+		triangle.varying_offset = context.varying_planes.size();
+		if (!depth_only && !varyings.empty()) {
+			float inverse_w[3];
+			for (size_t i = 0; i < 3; ++i) {
+				inverse_w[i] = 1.f / clip_vertices[i]->position.w;
+			}
+			triangle.inverse_w = make_plane(inverse_w[0], inverse_w[1], inverse_w[2]);
+			for (size_t offset: varyings) {
+				float values[3];
+				for (size_t i = 0; i < 3; ++i) {
+					const char* data = reinterpret_cast<const char*>(&clip_vertices[i]->data);
+					values[i] = *reinterpret_cast<const float*>(data + offset) * inverse_w[i];
+				}
+				context.varying_planes.push_back(make_plane(values[0], values[1], values[2]));
+			}
+		}
+
+		unsigned int triangle_id = static_cast<unsigned int>(context.triangles.size());
+		context.triangles.push_back(triangle);
+
+		for (size_t tile_y = triangle.bounding_box_begin.y / tile_size; tile_y <= triangle.bounding_box_end.y / tile_size; ++tile_y) {
+			for (size_t tile_x = triangle.bounding_box_begin.x / tile_size; tile_x <= triangle.bounding_box_end.x / tile_size; ++tile_x) {
+				context.bins[tile_y * tiles_x + tile_x].push_back(triangle_id);
+			}
+		}
+	}
+
+	template<typename VB, typename RT, typename VS, typename PS>
+	inline int rasterizer<VB, RT, VS, PS>::get_footprint_coverage(const screen_triangle& triangle) const
+	{
+		// Over the footprint of a small triangle the edge functions fit 32 bits
+		constexpr int rows_per_register = simd::lanes / footprint_size;
+		int2 begin = triangle.bounding_box_begin;
+		int num_offsets = is_multisampled() ? num_samples : 1;
+		int coverage = 0;
+		for (int offset = 0; offset < num_offsets; ++offset) {
+			int offset_x = is_multisampled() ? sample_offsets[offset][0] : 0;
+			int offset_y = is_multisampled() ? sample_offsets[offset][1] : 0;
+			for (int row = 0; row < footprint_size; row += rows_per_register) {
+				simd::int_v edges[3];
+				for (size_t i = 0; i < 3; ++i) {
+					int64_t edge = triangle.edge_a[i] * (begin.x * subpixel_scale + subpixel_scale / 2 + offset_x) +
+								   triangle.edge_b[i] * ((begin.y + row) * subpixel_scale + subpixel_scale / 2 + offset_y) +
+								   triangle.edge_c[i];
+					edges[i] = simd::footprint(
+							static_cast<int>(edge),
+							static_cast<int>(triangle.edge_a[i] * subpixel_scale),
+							static_cast<int>(triangle.edge_b[i] * subpixel_scale));
+				}
+				coverage |= simd::all_nonnegative(edges[0], edges[1], edges[2]) << (row * footprint_size);
+			}
+		}
+		return coverage;
+	}
+
+	template<typename VB, typename RT, typename VS, typename PS>
+	inline void rasterizer<VB, RT, VS, PS>::rasterize_tile(
+			size_t tile_x, size_t tile_y, const binning_context* contexts,
+			size_t num_contexts, size_t thread_id)
+	{
+		size_t tile_id = tile_y * get_tiles_x() + tile_x;
+		int2 clip_begin{static_cast<int>(tile_x * tile_size), static_cast<int>(tile_y * tile_size)};
+		int2 clip_end{
+				static_cast<int>(std::min((tile_x + 1) * tile_size, width) - 1),
+				static_cast<int>(std::min((tile_y + 1) * tile_size, height) - 1)};
+
+		tile_targets targets{
+				render_target ? &render_target->item(0) : nullptr,
+				depth_buffer ? &depth_buffer->item(0) : nullptr,
+				int2{0, 0}, width};
+
+		// A tile buffer is loaded from the targets, or from the clear values
+		// of a tagged tile, and stored back in whole rows. Otherwise a tile
+		// still tagged here is filled in the targets
+		bool buffered = is_tile_buffered();
+		bool is_cleared = cleared_tiles[tile_id];
+		if (is_cleared && !buffered) {
+			for (size_t y = clip_begin.y; y <= static_cast<size_t>(clip_end.y); ++y) {
+				fill_cleared_row(tile_x, y);
+			}
+			cleared_tiles[tile_id] = 0;
+			is_cleared = false;
+		}
+		bool write_colors = render_target && (!depth_only || is_cleared);
+		bool write_depth = depth_buffer && (depth_comparison == depth_function::less || is_cleared);
+		size_t tile_width = clip_end.x - clip_begin.x + 1;
+		if (buffered) {
+			tile_buffer& buffer = thread_tile_buffers[thread_id];
+			for (int y = clip_begin.y; y <= clip_end.y; ++y) {
+				size_t row = (y - clip_begin.y) * tile_width;
+				size_t pixel = y * width + clip_begin.x;
+				if (is_cleared) {
+					std::fill(buffer.colors.begin() + row, buffer.colors.begin() + row + tile_width, clear_value);
+					std::fill(buffer.depths.begin() + row, buffer.depths.begin() + row + tile_width, clear_depth);
+					continue;
+				}
+				if (!depth_only)
+					std::copy(targets.colors + pixel, targets.colors + pixel + tile_width, buffer.colors.begin() + row);
+				if (depth_buffer)
+					std::copy(targets.depths + pixel, targets.depths + pixel + tile_width, buffer.depths.begin() + row);
+			}
+			targets = tile_targets{
+					buffer.colors.data(), depth_buffer ? buffer.depths.data() : nullptr,
+					clip_begin, tile_width};
+		}
+
+		size_t shaded = 0;
+		for (size_t context_id = 0; context_id < num_contexts; ++context_id) {
+			const binning_context& context = contexts[context_id];
+			for (unsigned int triangle_id: context.bins[tile_id]) {
+				const screen_triangle& triangle = context.triangles[triangle_id];
+				if (depth_buffer) {
+					// The nearest point of the triangle is behind everything
+					// stored in the tile
+					float nearest_depth = std::min({triangle.vertices[0].z, triangle.vertices[1].z, triangle.vertices[2].z});
+					if (is_occluded(nearest_depth, tile_max_depth[tile_id])) {
+						continue;
+					}
+				}
+				if (rasterize_triangle(
+							triangle, context.varying_planes.data() + triangle.varying_offset, targets,
+							context.visible_offset + triangle_id, clip_begin, clip_end, shaded)) {
+					update_tile_max_depth(tile_x, tile_y);
+				}
+			}
+		}
+
+		if (buffered) {
+			for (int y = clip_begin.y; y <= clip_end.y; ++y) {
+				const RT* colors = targets.colors + (y - clip_begin.y) * tile_width;
+				size_t pixel = y * width + clip_begin.x;
+				if (write_colors)
+					std::copy(colors, colors + tile_width, &render_target->item(pixel));
+				if (write_depth) {
+					const float* depths = targets.depths + (y - clip_begin.y) * tile_width;
+					std::copy(depths, depths + tile_width, &depth_buffer->item(pixel));
+				}
+			}
+			cleared_tiles[tile_id] = 0;
+		}
+		shaded_fragments += shaded;
+	}
+
+	template<typename VB, typename RT, typename VS, typename PS>
+	inline bool rasterizer<VB, RT, VS, PS>::rasterize_triangle(
+			const screen_triangle& triangle, const float3* varying_planes, const tile_targets& targets,
+			unsigned int visible_id, int2 clip_begin, int2 clip_end, size_t& shaded)
+	{
+		int2 begin = max(triangle.bounding_box_begin, clip_begin);
+		int2 end = min(triangle.bounding_box_end, clip_end);
+		size_t blocks_x = get_depth_blocks_x();
+		coarse_color coarse_cache[coarse_cache_size]{};
+		auto shade = [&](int x, int y, float depth) {
+			size_t offset = (y - targets.origin.y) * targets.stride + x - targets.origin.x;
+			if (!targets.depths || depth_test(depth, targets.depths[offset])) {
+				if (deferred_shading && !depth_only) {
+					visibility_buffer[y * width + x] = visible_id;
+				}
+				else if (!depth_only) {
+					targets.colors[offset] = shade_pixel(triangle, varying_planes, x, y, depth, coarse_cache, shaded);
+				}
+				if (targets.depths && depth_comparison == depth_function::less)
+					targets.depths[offset] = depth;
+			}
+		};
+
+		// Samples of a pixel: the ones passing the depth test share one
+		// pixel_shader invocation. A triangle covering a compressed pixel
+		// keeps it compressed, the center stands for all samples
+		bool multisampled = is_multisampled();
+		auto shade_samples = [&](int x, int y, float depth, int sample_mask) {
+			size_t pixel = y * width + x;
+			RT* colors = sample_colors.data() + pixel * num_samples;
+			float* depths = sample_depths.data() + pixel * num_samples;
+			bool write_depth = depth_buffer && depth_comparison == depth_function::less;
+
+			auto get_sample_depth = [](float center_depth, float gradient_x, float gradient_y, int sample) {
+				return center_depth + (gradient_x * sample_offsets[sample][0] + gradient_y * sample_offsets[sample][1]) / subpixel_scale;
+			};
+			auto compress = [&]() {
+				compressed_pixels[pixel] = 1;
+				depths[0] = depth;
+				depths[1] = triangle.depth.x;
+				depths[2] = triangle.depth.y;
 			};
+			auto passes = [&](float z, float stored_z) {
+				return !depth_buffer || depth_test(z, stored_z);
+			};
+
+			// Every covered sample is compared to the exact depth of the
+			// sample, also in a compressed pixel
+			float stored_z[num_samples];
+			bool is_compressed = compressed_pixels[pixel];
+			for (int sample = 0; sample < num_samples; ++sample) {
+				stored_z[sample] = is_compressed ? get_sample_depth(depths[0], depths[1], depths[2], sample) : depths[sample];
+			}
+			float sample_z[num_samples];
+			int passed = 0;
+			for (int sample = 0; sample < num_samples; ++sample) {
+				sample_z[sample] = get_sample_depth(depth, triangle.depth.x, triangle.depth.y, sample);
+				if (sample_mask & 1 << sample && passes(sample_z[sample], stored_z[sample])) {
+					passed |= 1 << sample;
+				}
+			}
+			if (!passed) {
+				return;
+			}
+			if (is_compressed && passed == all_samples) {
+				// The triangle is in front of every sample, or the same
+				// surface for the equal test, the pixel stays compressed
+				if (!depth_only) {
+					colors[0] = shade_pixel(triangle, varying_planes, x, y, depth, coarse_cache, shaded);
+				}
+				if (write_depth)
+					compress();
+				return;
+			}
+
+			RT color{};
+			if (!depth_only) {
+				color = shade_pixel(triangle, varying_planes, x, y, depth, coarse_cache, shaded);
+				if (passed == all_samples && depth_comparison == depth_function::less) {
+					// The triangle is in front of every sample
+					colors[0] = color;
+					compress();
+					return;
+				}
+			}
+			if (is_compressed) {
+				std::fill(colors + 1, colors + num_samples, colors[0]);
+				std::copy(stored_z, stored_z + num_samples, depths);
+				compressed_pixels[pixel] = 0;
+			}
+			for (int sample = 0; sample < num_samples; ++sample) {
+				if (passed & 1 << sample) {
+					if (!depth_only)
+						colors[sample] = color;
+					if (write_depth)
+						depths[sample] = sample_z[sample];
+				}
+			}
+		};
+
+		// The depth plane over the pixel indices loses precision on thin
+		// triangles, the depths are clamped to the ones of the vertices
+		float nearest_depth = std::min({triangle.vertices[0].z, triangle.vertices[1].z, triangle.vertices[2].z});
+		float farthest_depth = std::max({triangle.vertices[0].z, triangle.vertices[1].z, triangle.vertices[2].z});
+		simd::float_v nearest_depths = simd::set(nearest_depth);
+		simd::float_v farthest_depths = simd::set(farthest_depth);
+
+		if (triangle.footprint_coverage) {
+			// Small triangle: the covered pixels are known from the setup
+			int coverage = triangle.footprint_coverage;
+			while (coverage) {
+				int bit = simd::lowest_lane(coverage);
+				coverage &= coverage - 1;
+				int x = triangle.bounding_box_begin.x + bit % footprint_size;
+				int y = triangle.bounding_box_begin.y + bit / footprint_size;
+				if (x >= clip_begin.x && x <= clip_end.x && y >= clip_begin.y && y <= clip_end.y) {
+					float depth = triangle.depth.x * x + triangle.depth.y * y + triangle.depth.z;
+					shade(x, y, std::clamp(depth, nearest_depth, farthest_depth));
+				}
+			}
+			return false;
+		}
+
+		// Edge functions at the center of a pixel
+		auto pixel_edges = [&](int x, int y, int64_t* edges) {
+			for (size_t i = 0; i < 3; ++i) {
+				edges[i] = triangle.edge_a[i] * (x * subpixel_scale + subpixel_scale / 2) +
+						   triangle.edge_b[i] * (y * subpixel_scale + subpixel_scale / 2) +
+						   triangle.edge_c[i];
+			}
+		};
+
+		// Inside of the guard band a row of a block and the offset to a
+		// sample change an edge function by less than 2^30, so clamping the
+		// row start to +-2^30 keeps the signs exact and the stepping in 32 bits
+		constexpr int64_t row_limit = int64_t{1} << 30;
+		int edge_steps[3];
+		simd::int_v edge_lane_steps[3];
+		for (size_t i = 0; i < 3; ++i) {
+			edge_steps[i] = static_cast<int>(triangle.edge_a[i] * subpixel_scale);
+			edge_lane_steps[i] = simd::set(edge_steps[i] * simd::lanes);
+		}
+		simd::float_v depth_lane_step = simd::set(triangle.depth.x * simd::lanes);
+
+		// Offsets of the edge functions and of the depth from the pixel
+		// center to the farthest sample
+		int64_t edge_reach[3]{};
+		simd::int_v sample_edge_offsets[3][num_samples];
+		float depth_reach = 0.f;
+		if (multisampled) {
+			for (size_t i = 0; i < 3; ++i) {
+				edge_reach[i] = (std::abs(triangle.edge_a[i]) + std::abs(triangle.edge_b[i])) * sample_reach;
+				for (int sample = 0; sample < num_samples; ++sample) {
+					sample_edge_offsets[i][sample] = simd::set(static_cast<int>(
+							triangle.edge_a[i] * sample_offsets[sample][0] + triangle.edge_b[i] * sample_offsets[sample][1]));
+				}
+			}
+			depth_reach = (std::abs(triangle.depth.x) + std::abs(triangle.depth.y)) * sample_reach / subpixel_scale;
+		}
+
+		bool max_depth_changed = false;
+
+		alignas(32) float depths[simd::lanes];
+		bool depth_only_spans = depth_only && !multisampled && targets.depths && depth_comparison == depth_function::less;
+
+		// Blocks of the hierarchical depth are classified by the edge
+		// functions and the depth plane at their corners before the scan
+		int2 block_begin = begin / depth_block_size * depth_block_size;
+		int64_t block_row_edges[3];
+		pixel_edges(block_begin.x, block_begin.y, block_row_edges);
+		for (int block_y = block_begin.y; block_y <= end.y; block_y += depth_block_size) {
+			int64_t block_edges[3]{block_row_edges[0], block_row_edges[1], block_row_edges[2]};
+			int last_y = std::min(depth_block_size, static_cast<int>(height) - block_y) - 1;
+
+			for (int block_x = block_begin.x; block_x <= end.x; block_x += depth_block_size) {
+				int last_x = std::min(depth_block_size, static_cast<int>(width) - block_x) - 1;
 
-			float edge = edge_function(
-					float2{vertices[0].x, vertices[0].y},
-					float2{vertices[1].x, vertices[1].y},
-					float2{vertices[2].x, vertices[2].y});
-
-			for (int x = static_cast<int>(bounding_box_begin.x); x <= static_cast<int>(bounding_box_end.x); x++) {
-				for (int y = static_cast<int>(bounding_box_begin.y); y <= static_cast<int>(bounding_box_end.y); y++) {
-					float2 point{static_cast<float>(x),
-								 static_cast<float>(y)};
-					float edge0 = edge_function(
-							float2{vertices[0].x, vertices[0].y},
-							float2{vertices[1].x, vertices[1].y},
-							point);
-					float edge1 = edge_function(
-							float2{vertices[1].x, vertices[1].y},
-							float2{vertices[2].x, vertices[2].y},
-							point);
-					float edge2 = edge_function(
-							float2{vertices[2].x, vertices[2].y},
-							float2{vertices[0].x, vertices[0].y},
-							point);
-
-					if (edge0 >= 0.f && edge1 >= 0.f && edge2 >= 0.f) {
-						float u = edge1 / edge;
-						float v = edge2 / edge;
-						float w = edge0 / edge;
-
-						float depth = u * vertices[0].z +
-									  v * vertices[1].z +
-									  w * vertices[2].z;
-						if (depth_test(depth, x, y)) {
-							auto pixel_result = pixel_shader(vertices[0], depth);
-							render_target->item(x, y) = RT::from_color(pixel_result);
-							if (depth_buffer)
-								depth_buffer->item(x, y) = depth;
+				bool is_outside = false;
+				bool is_covered = true;
+				int64_t edges[3];
+				for (size_t i = 0; i < 3; ++i) {
+					edges[i] = block_edges[i];
+					int64_t corner_x = triangle.edge_a[i] * subpixel_scale * last_x;
+					int64_t corner_y = triangle.edge_b[i] * subpixel_scale * last_y;
+					int64_t edge_min = block_edges[i] + std::min<int64_t>(corner_x, 0) + std::min<int64_t>(corner_y, 0) - edge_reach[i];
+					int64_t edge_max = block_edges[i] + std::max<int64_t>(corner_x, 0) + std::max<int64_t>(corner_y, 0) + edge_reach[i];
+					is_outside |= edge_max < 0;
+					is_covered &= edge_min >= 0;
+					block_edges[i] += triangle.edge_a[i] * subpixel_scale * depth_block_size;
+				}
+				if (is_outside) {
+					// All corners are outside of one edge
+					continue;
+				}
+
+				float corner_depth = triangle.depth.x * block_x + triangle.depth.y * block_y + triangle.depth.z;
+				float corner_x = triangle.depth.x * last_x;
+				float corner_y = triangle.depth.y * last_y;
+				float block_nearest_depth = std::max(
+						corner_depth + std::min(corner_x, 0.f) + std::min(corner_y, 0.f) - depth_reach, nearest_depth);
+				float block_farthest_depth = std::min(
+						corner_depth + std::max(corner_x, 0.f) + std::max(corner_y, 0.f) + depth_reach, farthest_depth);
+
+				size_t block_id = (block_y / depth_block_size) * blocks_x + block_x / depth_block_size;
+				if (depth_buffer && is_occluded(block_nearest_depth, block_max_depth[block_id])) {
+					continue;
+				}
+
+				int2 span_begin = max(int2{block_x, block_y}, begin);
+				int2 span_end = min(int2{block_x + last_x, block_y + last_y}, end);
+				for (size_t i = 0; i < 3; ++i) {
+					edges[i] += (triangle.edge_a[i] * (span_begin.x - block_x) + triangle.edge_b[i] * (span_begin.y - block_y)) * subpixel_scale;
+				}
+				for (int y = span_begin.y; y <= span_end.y; y++) {
+					simd::int_v edge_values[3];
+					for (size_t i = 0; i < 3; ++i) {
+						edge_values[i] = simd::ramp(static_cast<int>(std::clamp(edges[i], -row_limit, row_limit)), edge_steps[i]);
+						edges[i] += triangle.edge_b[i] * subpixel_scale;
+					}
+					simd::float_v depth_values = simd::set(triangle.depth.x * span_begin.x + triangle.depth.y * y + triangle.depth.z) +
+												 simd::lane_indices() * simd::set(triangle.depth.x);
+
+					for (int x = span_begin.x; x <= span_end.x; x += simd::lanes) {
+						int span_lanes = simd::first_lanes(span_end.x - x + 1);
+						int coverage = 0;
+						int sample_coverage[num_samples];
+						if (multisampled) {
+							for (int sample = 0; sample < num_samples; ++sample) {
+								sample_coverage[sample] = simd::all_nonnegative(
+																  edge_values[0] + sample_edge_offsets[0][sample],
+																  edge_values[1] + sample_edge_offsets[1][sample],
+																  edge_values[2] + sample_edge_offsets[2][sample]) &
+														  span_lanes;
+								coverage |= sample_coverage[sample];
+							}
+						}
+						else {
+							coverage = simd::all_nonnegative(edge_values[0], edge_values[1], edge_values[2]) & span_lanes;
 						}
+						if (coverage && depth_only_spans && span_lanes == simd::first_lanes(simd::lanes)) {
+							// The covered lanes keep the nearer of both depths
+							float* stored = targets.depths + (y - targets.origin.y) * targets.stride + x - targets.origin.x;
+							simd::float_v stored_depths = simd::load(stored);
+							simd::float_v pixel_depths = simd::min(simd::max(depth_values, nearest_depths), farthest_depths);
+							simd::store(stored, simd::blend(coverage, simd::min(pixel_depths, stored_depths), stored_depths));
+						}
+						else if (coverage) {
+							simd::store(depths, simd::min(simd::max(depth_values, nearest_depths), farthest_depths));
+							while (coverage) {
+								int lane = simd::lowest_lane(coverage);
+								coverage &= coverage - 1;
+								if (!multisampled) {
+									shade(x + lane, y, depths[lane]);
+									continue;
+								}
+								int sample_mask = 0;
+								for (int sample = 0; sample < num_samples; ++sample) {
+									sample_mask |= (sample_coverage[sample] >> lane & 1) << sample;
+								}
+								shade_samples(x + lane, y, depths[lane], sample_mask);
+							}
+						}
+
+						edge_values[0] += edge_lane_steps[0];
+						edge_values[1] += edge_lane_steps[1];
+						edge_values[2] += edge_lane_steps[2];
+						depth_values += depth_lane_step;
 					}
 				}
+
+				// Every pixel of a covered block now stores at most the
+				// farthest depth of the triangle over the block. The stepped
+				// depths may round a few ulps past it, so it gets a margin
+				float stored_max_depth = block_farthest_depth + std::abs(block_farthest_depth) * 1e-5f;
+				if (depth_buffer && depth_comparison == depth_function::less &&
+					is_covered && stored_max_depth < block_max_depth[block_id]) {
+					block_max_depth[block_id] = stored_max_depth;
+					max_depth_changed = true;
+				}
+			}
+
+			for (size_t i = 0; i < 3; ++i) {
+				block_row_edges[i] += triangle.edge_b[i] * subpixel_scale * depth_block_size;
 			}
 		}
-		std::cout << std::endl;
+		return max_depth_changed;
 	}
 
+	template<typename VB, typename RT, typename VS, typename PS>
+	inline VB rasterizer<VB, RT, VS, PS>::interpolate_vertex(
+			const screen_triangle& triangle, const float3* varying_planes, float x, float y) const
+	{
+		// The declared varyings with perspective correction, the rest of
+		// the first vertex as it is
+		VB vertex = triangle.vertices[0];
+		if (varyings.empty()) {
+			return vertex;
+		}
+		float w = 1.f / (triangle.inverse_w.x * x + triangle.inverse_w.y * y + triangle.inverse_w.z);
+		char* data = reinterpret_cast<char*>(&vertex);
+		for (size_t i = 0; i < varyings.size(); ++i) {
+			const float3& plane = varying_planes[i];
+			*reinterpret_cast<float*>(data + varyings[i]) = (plane.x * x + plane.y * y + plane.z) * w;
+		}
+		return vertex;
+	}
+
+	template<typename VB, typename RT, typename VS, typename PS>
+	inline int rasterizer<VB, RT, VS, PS>::get_coarse_size(const screen_triangle& triangle, int x, int y) const
+	{
+		int size = static_cast<int>(triangle.rate);
+		if (shading_rate_image) {
+			size = std::max(size, static_cast<int>(shading_rate_image->item(x / depth_block_size, y / depth_block_size)));
+		}
+		return size;
+	}
 
-	template<typename VB, typename RT>
-	inline float
-	rasterizer<VB, RT>::edge_function(float2 a, float2 b, float2 c)
+	template<typename VB, typename RT, typename VS, typename PS>
+	inline RT rasterizer<VB, RT, VS, PS>::shade_pixel(
+			const screen_triangle& triangle, const float3* varying_planes,
+			int x, int y, float depth, coarse_color* cache, size_t& shaded)
 	{
-		return (c.x - a.x) * (b.y - a.y) - (c.y - a.y) * (b.x - a.x);
+		int size = get_coarse_size(triangle, x, y);
+		if (size == 1) {
+			shaded++;
+			return RT::from_color(varyings.empty() ?
+										  pixel_shader(triangle.vertices[0], depth) :
+										  pixel_shader(interpolate_vertex(triangle, varying_planes, x, y), depth));
+		}
+
+		// The center of the block may be out of the triangle, the varyings
+		// are extrapolated there and the depth is clamped as for the pixels
+		int2 origin{x - x % size, y - y % size};
+		coarse_color& cached = cache[(origin.x / size) % 4 + (origin.y / size) % 4 * 4];
+		if (cached.triangle != &triangle || cached.origin.x != origin.x || cached.origin.y != origin.y || cached.size != size) {
+			float center_x = origin.x + (size - 1) / 2.f;
+			float center_y = origin.y + (size - 1) / 2.f;
+			float center_depth = std::clamp(
+					triangle.depth.x * center_x + triangle.depth.y * center_y + triangle.depth.z,
+					std::min({triangle.vertices[0].z, triangle.vertices[1].z, triangle.vertices[2].z}),
+					std::max({triangle.vertices[0].z, triangle.vertices[1].z, triangle.vertices[2].z}));
+			cached = coarse_color{
+					&triangle, origin, size,
+					RT::from_color(pixel_shader(interpolate_vertex(triangle, varying_planes, center_x, center_y), center_depth))};
+			shaded++;
+		}
+		return cached.color;
+	}
+
+	template<typename VB, typename RT, typename VS, typename PS>
+	inline void rasterizer<VB, RT, VS, PS>::shade_visible_pixels()
+	{
+		finish();
+		if (visibility_buffer.size() != width * height) {
+			return;
+		}
+
+		// Tiles still tagged by a clear were not drawn to. A thread shades
+		// bands of 4 rows in blocks of 4 x 4 pixels, so the pixels of a
+		// coarse block are shaded together
+		constexpr int band_size = static_cast<int>(shading_rate::rate_4x4);
+		size_t tiles_x = get_tiles_x();
+		size_t shaded = 0;
+#pragma omp parallel for schedule(static) reduction(+ : shaded)
+		for (int band_y = 0; band_y < static_cast<int>(height); band_y += band_size) {
+			coarse_color coarse_cache[coarse_cache_size]{};
+			int end_y = std::min(band_y + band_size, static_cast<int>(height));
+			for (size_t tile_x = 0; tile_x < tiles_x; ++tile_x) {
+				if (cleared_tiles[(band_y / tile_size) * tiles_x + tile_x]) {
+					continue;
+				}
+				int end_x = static_cast<int>(std::min((tile_x + 1) * tile_size, width));
+				for (int block_x = static_cast<int>(tile_x * tile_size); block_x < end_x; block_x += band_size) {
+					for (int y = band_y; y < end_y; ++y) {
+						for (int x = block_x; x < std::min(block_x + band_size, end_x); ++x) {
+							unsigned int& visible_id = visibility_buffer[y * width + x];
+							if (visible_id == no_triangle) {
+								continue;
+							}
+							const screen_triangle& triangle = visible_triangles[visible_id];
+							render_target->item(x, y) = shade_pixel(
+									triangle, visible_varying_planes.data() + triangle.varying_offset,
+									x, y, depth_buffer->item(x, y), coarse_cache, shaded);
+							visible_id = no_triangle;
+						}
+					}
+				}
+			}
+		}
+		shaded_fragments += shaded;
+
+		visible_triangles.clear();
+		visible_varying_planes.clear();
+	}
+
+	template<typename VB, typename RT, typename VS, typename PS>
+	inline void rasterizer<VB, RT, VS, PS>::resolve_samples()
+	{
+		finish();
+		if (!has_samples()) {
+			return;
+		}
+
+		// The depth buffer gets the farthest sample of a pixel. Tiles still
+		// tagged by a clear get the clear values, their samples stay tagged
+		size_t tiles_x = get_tiles_x();
+#pragma omp parallel for schedule(static)
+		for (int y = 0; y < static_cast<int>(height); ++y) {
+			for (size_t tile_x = 0; tile_x < tiles_x; ++tile_x) {
+				size_t begin = y * width + tile_x * tile_size;
+				size_t end = y * width + std::min((tile_x + 1) * tile_size, width);
+				if (cleared_tiles[(y / tile_size) * tiles_x + tile_x]) {
+					render_target->fill(clear_value, begin, end);
+					if (depth_buffer)
+						depth_buffer->fill(clear_depth, begin, end);
+					continue;
+				}
+				for (size_t pixel = begin; pixel < end; ++pixel) {
+					const RT* colors = sample_colors.data() + pixel * num_samples;
+					const float* depths = sample_depths.data() + pixel * num_samples;
+					if (compressed_pixels[pixel]) {
+						render_target->item(pixel) = colors[0];
+						if (depth_buffer)
+							depth_buffer->item(pixel) = depths[0];
+						continue;
+					}
+					float3 color{0.f, 0.f, 0.f};
+					for (int sample = 0; sample < num_samples; ++sample) {
+						color += colors[sample].to_float3();
+					}
+					render_target->item(pixel) = RT::from_float3(color / static_cast<float>(num_samples));
+					if (depth_buffer)
+						depth_buffer->item(pixel) = *std::max_element(depths, depths + num_samples);
+				}
+			}
+		}
 	}
 
-	template<typename VB, typename RT>
-	inline bool rasterizer<VB, RT>::depth_test(float z, size_t x, size_t y)
+	template<typename VB, typename RT, typename VS, typename PS>
+	inline bool rasterizer<VB, RT, VS, PS>::depth_test(float z, float stored_z) const
 	{
-		return !depth_buffer || depth_buffer->item(x, y) > z;
+		if (depth_comparison == depth_function::equal)
+			return stored_z == z;
+		return stored_z > z;
 	}
 
 }// namespace cg::renderer
\ No newline at end of file
@@ -1,7 +1,15 @@
 #include "rasterizer_renderer.h"
 
+#include "utils/error_handler.h"
 #include "utils/resource_utils.h"
 
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <iostream>
+#include <numeric>
+
 void cg::renderer::rasterization_renderer::init()
 {
 	// Load model
@@ -26,12 +34,303 @@ void cg::renderer::rasterization_renderer::init()
 	depth_buffer = std::make_shared<resource<float>>(settings->width, settings->height);
 
 	// Create rasterizer
-	rasterizer = std::make_shared<cg::renderer::rasterizer<cg::vertex, cg::unsigned_color>>();
+	rasterizer = std::make_shared<cg::renderer::rasterizer<
+			cg::vertex, cg::unsigned_color, transform_vertex_shader, lit_pixel_shader>>();
 	rasterizer->set_render_target(render_target, depth_buffer);
 	rasterizer->set_viewport(settings->width, settings->height);
+	rasterizer->set_deferred_shading(settings->deferred_shading);
+	rasterizer->set_multisampling(settings->msaa);
+	rasterizer->set_tile_buffers(settings->tile_buffers);
+	rasterizer->set_pipelined(settings->pipelined);
+
+	if (settings->shading_rate == "2x2") {
+		shape_shading_rate = shading_rate::rate_2x2;
+	}
+	else if (settings->shading_rate == "4x4") {
+		shape_shading_rate = shading_rate::rate_4x4;
+	}
+	else if (settings->shading_rate != "1x1") {
+		THROW_ERROR("Unknown shading rate: " + settings->shading_rate);
+	}
+
+	build_bounds();
+
+	if (settings->shadows) {
+		if (settings->shadow_map_size == 0) {
+			THROW_ERROR("Shadow map size has to be positive");
+		}
+		shadow_map = std::make_shared<resource<float>>(settings->shadow_map_size, settings->shadow_map_size);
+		shadow_rasterizer = std::make_shared<cg::renderer::rasterizer<
+				cg::vertex, cg::unsigned_color, transform_vertex_shader, lit_pixel_shader>>();
+		shadow_rasterizer->set_render_target(nullptr, shadow_map);
+		shadow_rasterizer->set_viewport(settings->shadow_map_size, settings->shadow_map_size);
+		// Both sides of the surfaces cast shadows
+		shadow_rasterizer->set_cull_mode(cull_mode::none);
+		shadow_rasterizer->set_depth_only(true);
+		shadow_rasterizer->set_tile_buffers(settings->tile_buffers);
+
+		rasterizer->set_varyings({
+				offsetof(cg::vertex, x), offsetof(cg::vertex, y), offsetof(cg::vertex, z),
+				offsetof(cg::vertex, nx), offsetof(cg::vertex, ny), offsetof(cg::vertex, nz)});
+		build_light();
+	}
+}
+
+void cg::renderer::rasterization_renderer::build_light()
+{
+	lit_pixel_shader& shader = rasterizer->pixel_shader;
+	float4x4 world = model->get_world_matrix();
+	const auto& vertex_buffers = model->get_vertex_buffers();
+	const auto& index_buffers = model->get_index_buffers();
+
+	// Centroid and normal of the emitters weighted by their power
+	float3 position{0.f, 0.f, 0.f};
+	float3 normal{0.f, 0.f, 0.f};
+	float3 intensity{0.f, 0.f, 0.f};
+	float total_power = 0.f;
+	for (size_t shape_id = 0; shape_id < index_buffers.size(); ++shape_id) {
+		const auto& vertex_buffer = vertex_buffers[shape_id];
+		const auto& index_buffer = index_buffers[shape_id];
+		for (size_t i = 0; i + 2 < index_buffer->get_number_of_elements(); i += 3) {
+			const cg::vertex& a = vertex_buffer->item(index_buffer->item(i));
+			const cg::vertex& b = vertex_buffer->item(index_buffer->item(i + 1));
+			const cg::vertex& c = vertex_buffer->item(index_buffer->item(i + 2));
+			float3 emission{a.emissive_r, a.emissive_g, a.emissive_b};
+			float3 position_a{a.x, a.y, a.z};
+			float3 position_b{b.x, b.y, b.z};
+			float3 position_c{c.x, c.y, c.z};
+			float3 geometric_normal = cross(position_b - position_a, position_c - position_a);
+			float area = length(geometric_normal) / 2.f;
+			float power = (emission.x + emission.y + emission.z) * area;
+			if (power <= 0.f) {
+				continue;
+			}
+			// Emit to the side the shading normals are facing
+			float3 shading_normal{a.nx + b.nx + c.nx, a.ny + b.ny + c.ny, a.nz + b.nz + c.nz};
+			if (dot(geometric_normal, shading_normal) < 0.f) {
+				geometric_normal = -geometric_normal;
+			}
+			position += (position_a + position_b + position_c) / 3.f * power;
+			normal += geometric_normal / (2.f * area) * power;
+			intensity += emission * area;
+			total_power += power;
+		}
+	}
+	if (total_power > 0.f && length(normal) > 0.f) {
+		float4 world_position = mul(world, float4{position.x / total_power, position.y / total_power, position.z / total_power, 1.f});
+		float4 world_normal = mul(world, float4{normal.x, normal.y, normal.z, 0.f});
+		shader.light_position = float3{world_position.x, world_position.y, world_position.z};
+		shader.light_direction = normalize(float3{world_normal.x, world_normal.y, world_normal.z});
+		shader.light_intensity = intensity;
+		shader.light_cosine = true;
+	}
+	else {
+		shader.light_position = float3{0.f, 1.58f, -0.03f};
+		shader.light_direction = float3{0.f, -1.f, 0.f};
+		shader.light_intensity = float3{2.45f, 2.45f, 2.45f};
+		shader.light_cosine = false;
+	}
+
+	// View from the light along its direction. The up axis of the camera
+	// is parallel to a light looking down, another one is taken then
+	float3 z_axis = -shader.light_direction;
+	float3 up = std::abs(z_axis.y) > 0.99f ? float3{0.f, 0.f, 1.f} : float3{0.f, 1.f, 0.f};
+	float3 x_axis = normalize(cross(up, z_axis));
+	float3 y_axis = cross(z_axis, x_axis);
+	float3 eye = shader.light_position;
+	float4x4 view{
+			{x_axis.x, y_axis.x, z_axis.x, 0.f},
+			{x_axis.y, y_axis.y, z_axis.y, 0.f},
+			{x_axis.z, y_axis.z, z_axis.z, 0.f},
+			{-dot(x_axis, eye), -dot(y_axis, eye), -dot(z_axis, eye), 1.f}};
+
+	// Square frustum with the depth range of the scene size
+	float3 scene_min{FLT_MAX, FLT_MAX, FLT_MAX};
+	float3 scene_max{-FLT_MAX, -FLT_MAX, -FLT_MAX};
+	for (const auto& shape: shapes) {
+		scene_min = min(scene_min, shape.bounds_min);
+		scene_max = max(scene_max, shape.bounds_max);
+	}
+	float diagonal = length(scene_max - scene_min);
+	float z_near = 0.01f * diagonal;
+	float z_far = 2.f * diagonal;
+	float f = 1.f / std::tan(shadow_angle_of_view / 2.f);
+	float4x4 projection{
+			{f, 0.f, 0.f, 0.f},
+			{0.f, f, 0.f, 0.f},
+			{0.f, 0.f, z_far / (z_near - z_far), -1.f},
+			{0.f, 0.f, (z_far * z_near) / (z_near - z_far), 0.f}};
+
+	shader.light_matrix = mul(projection, view);
+	shader.shadow_map = shadow_map;
+	shader.shadow_map_size = static_cast<int>(settings->shadow_map_size);
+	shader.texel_size = 2.f / (f * static_cast<float>(settings->shadow_map_size));
+	shader.pcf_radius = static_cast<int>(settings->pcf_radius);
+}
+
+void cg::renderer::rasterization_renderer::render_shadow_map()
+{
+	// Depth-only draws of every shape, without culling by the camera
+	shadow_rasterizer->vertex_shader.matrix = mul(rasterizer->pixel_shader.light_matrix, model->get_world_matrix());
+	shadow_rasterizer->vertex_shader.world = model->get_world_matrix();
+	shadow_rasterizer->clear_render_target({0, 0, 0});
+	for (size_t i = 0; i < shapes.size(); ++i) {
+		const auto& index_buffer = model->get_index_buffers()[i];
+		shadow_rasterizer->set_vertex_buffer(model->get_vertex_buffers()[i]);
+		shadow_rasterizer->set_index_buffer(index_buffer);
+		shadow_rasterizer->draw(index_buffer->get_number_of_elements(), 0);
+	}
+	shadow_rasterizer->resolve_clears();
+}
+
+void cg::renderer::rasterization_renderer::build_bounds()
+{
+	const auto& vertex_buffers = model->get_vertex_buffers();
+	const auto& index_buffers = model->get_index_buffers();
+
+	clusters.clear();
+	sorted_index_buffers.clear();
+	shapes.clear();
+	for (size_t shape_id = 0; shape_id < index_buffers.size(); ++shape_id) {
+		const auto& vertex_buffer = vertex_buffers[shape_id];
+		const auto& index_buffer = index_buffers[shape_id];
+		size_t num_indices = index_buffer->get_number_of_elements();
+
+		for (size_t first_index = 0; first_index < num_indices; first_index += cluster_size * 3) {
+			triangle_cluster cluster{};
+			cluster.shape_id = shape_id;
+			cluster.first_index = first_index;
+			cluster.num_indices = std::min(cluster_size * 3, num_indices - first_index);
+			cluster.bounds_min = float3{FLT_MAX, FLT_MAX, FLT_MAX};
+			cluster.bounds_max = float3{-FLT_MAX, -FLT_MAX, -FLT_MAX};
+			for (size_t i = first_index; i < first_index + cluster.num_indices; ++i) {
+				const cg::vertex& vertex = vertex_buffer->item(index_buffer->item(i));
+				float3 position{vertex.x, vertex.y, vertex.z};
+				cluster.bounds_min = min(cluster.bounds_min, position);
+				cluster.bounds_max = max(cluster.bounds_max, position);
+			}
+			clusters.push_back(cluster);
+		}
+		sorted_index_buffers.push_back(std::make_shared<cg::resource<unsigned int>>(num_indices));
+
+		auto shading_attributes = [](const cg::vertex& vertex) {
+			return std::array<float, 12>{
+					vertex.nx, vertex.ny, vertex.nz,
+					vertex.ambient_r, vertex.ambient_g, vertex.ambient_b,
+					vertex.diffuse_r, vertex.diffuse_g, vertex.diffuse_b,
+					vertex.emissive_r, vertex.emissive_g, vertex.emissive_b};
+		};
+		shape_bounds shape{float3{FLT_MAX, FLT_MAX, FLT_MAX}, float3{-FLT_MAX, -FLT_MAX, -FLT_MAX}, false, true};
+		for (size_t i = 0; i < num_indices; ++i) {
+			const cg::vertex& vertex = vertex_buffer->item(index_buffer->item(i));
+			float3 position{vertex.x, vertex.y, vertex.z};
+			shape.bounds_min = min(shape.bounds_min, position);
+			shape.bounds_max = max(shape.bounds_max, position);
+			shape.is_flat &= shading_attributes(vertex) == shading_attributes(vertex_buffer->item(index_buffer->item(0)));
+		}
+		shapes.push_back(shape);
+	}
+
+	float3 scene_min{FLT_MAX, FLT_MAX, FLT_MAX};
+	float3 scene_max{-FLT_MAX, -FLT_MAX, -FLT_MAX};
+	for (const auto& shape: shapes) {
+		scene_min = min(scene_min, shape.bounds_min);
+		scene_max = max(scene_max, shape.bounds_max);
+	}
+	for (auto& shape: shapes) {
+		shape.is_occluder = length(shape.bounds_max - shape.bounds_min) >= occluder_size * length(scene_max - scene_min);
+	}
+}
+
+void cg::renderer::rasterization_renderer::sort_front_to_back()
+{
+	// Depth of the nearest corner of the bounds along the view direction
+	float3 position = camera->get_position();
+	float3 direction = camera->get_direction();
+	for (auto& cluster: clusters) {
+		float3 center = (cluster.bounds_min + cluster.bounds_max) / 2.f;
+		float3 extent = (cluster.bounds_max - cluster.bounds_min) / 2.f;
+		cluster.depth = dot(center - position, direction) - dot(abs(direction), extent);
+	}
+	std::sort(clusters.begin(), clusters.end(), [](const triangle_cluster& a, const triangle_cluster& b) {
+		return a.depth < b.depth;
+	});
+
+	// Shapes go in the order of their nearest clusters, the clusters of a
+	// shape are copied to its sorted index buffer front to back
+	const auto& index_buffers = model->get_index_buffers();
+	std::vector<size_t> sorted_indices(index_buffers.size(), 0);
+	shape_order.clear();
+	for (const auto& cluster: clusters) {
+		size_t& offset = sorted_indices[cluster.shape_id];
+		if (offset == 0) {
+			shape_order.push_back(cluster.shape_id);
+		}
+		const auto& index_buffer = index_buffers[cluster.shape_id];
+		const auto& sorted_index_buffer = sorted_index_buffers[cluster.shape_id];
+		for (size_t i = 0; i < cluster.num_indices; ++i) {
+			sorted_index_buffer->item(offset + i) = index_buffer->item(cluster.first_index + i);
+		}
+		offset += cluster.num_indices;
+	}
+}
+
+bool cg::renderer::rasterization_renderer::is_shape_visible(size_t shape_id) const
+{
+	const shape_bounds& shape = shapes[shape_id];
+	if (shape.bounds_min.x > shape.bounds_max.x) {
+		return false;
+	}
+	float4 corners[8];
+	for (size_t i = 0; i < 8; ++i) {
+		float4 corner{
+				i & 1 ? shape.bounds_max.x : shape.bounds_min.x,
+				i & 2 ? shape.bounds_max.y : shape.bounds_min.y,
+				i & 4 ? shape.bounds_max.z : shape.bounds_min.z,
+				1.f};
+		corners[i] = mul(rasterizer->vertex_shader.matrix, corner);
+	}
+	return rasterizer->is_box_visible(corners);
+}
+
+void cg::renderer::rasterization_renderer::build_shading_rate_image()
+{
+	size_t blocks_x = (settings->width + 7) / 8;
+	size_t blocks_y = (settings->height + 7) / 8;
+	if (!shading_rate_image) {
+		shading_rate_image = std::make_shared<cg::resource<shading_rate>>(blocks_x, blocks_y);
+	}
+
+	// Largest difference of a channel in a block
+#pragma omp parallel for schedule(static)
+	for (int block_y = 0; block_y < static_cast<int>(blocks_y); ++block_y) {
+		for (size_t block_x = 0; block_x < blocks_x; ++block_x) {
+			std::array<int, 3> low{255, 255, 255};
+			std::array<int, 3> high{0, 0, 0};
+			for (size_t y = block_y * 8; y < std::min<size_t>(block_y * 8 + 8, settings->height); ++y) {
+				for (size_t x = block_x * 8; x < std::min<size_t>(block_x * 8 + 8, settings->width); ++x) {
+					const cg::unsigned_color& color = render_target->item(x, y);
+					std::array<int, 3> channels{color.r, color.g, color.b};
+					for (size_t i = 0; i < 3; ++i) {
+						low[i] = std::min(low[i], channels[i]);
+						high[i] = std::max(high[i], channels[i]);
+					}
+				}
+			}
+			int contrast = std::max({high[0] - low[0], high[1] - low[1], high[2] - low[2]});
+			shading_rate_image->item(block_x, block_y) =
+					contrast <= flat_contrast	? shading_rate::rate_4x4 :
+					contrast <= smooth_contrast ? shading_rate::rate_2x2 :
+												  shading_rate::rate_1x1;
+		}
+	}
+	rasterizer->set_shading_rate_image(shading_rate_image);
 }
 
-void cg::renderer::rasterization_renderer::destroy() {}
+void cg::renderer::rasterization_renderer::destroy()
+{
+	utils::save_resource(*render_target, settings->result_path);
+}
 
 void cg::renderer::rasterization_renderer::update() {}
 
@@ -40,30 +339,89 @@ void cg::renderer::rasterization_renderer::render()
 
 	rasterizer->clear_render_target({15, 15, 15});
 
-	float4x4 matrix = mul(
+	rasterizer->vertex_shader.matrix = mul(
 			camera->get_projection_matrix(),
 			camera->get_view_matrix(),
 			model->get_world_matrix()
 	);
+	rasterizer->vertex_shader.world = model->get_world_matrix();
 
-	rasterizer->vertex_shader = [&](float4 vertex, cg::vertex vertex_data) {
-		auto processed_vertex = mul(matrix, vertex);
-		return std::make_pair(processed_vertex, vertex_data);
-	};
+	if (settings->shadows) {
+		render_shadow_map();
+		rasterizer->pixel_shader.camera_position = camera->get_position();
+	}
 
-	rasterizer->pixel_shader = [&](cg::vertex vertex_data, float z) {
-		return cg::color{
-				vertex_data.ambient_r,
-				vertex_data.ambient_g,
-				vertex_data.ambient_b,
-		};
+	if (settings->front_to_back) {
+		sort_front_to_back();
+		draw_order = shape_order;
+	}
+	else {
+		draw_order.resize(shapes.size());
+		std::iota(draw_order.begin(), draw_order.end(), 0);
+	}
+	if (settings->occlusion_culling) {
+		std::stable_partition(draw_order.begin(), draw_order.end(), [&](size_t i) {
+			return shapes[i].is_occluder;
+		});
+	}
+
+	// Hidden shapes skip the draw call with its vertex stage. The first
+	// pass drops them from the draw order, so the color pass after a depth
+	// prepass draws the same shapes without testing them again
+	size_t culled_draws = 0;
+	auto draw_shapes = [&](bool cull_shapes) {
+		bool occluders_drawn = false;
+		size_t num_drawn = 0;
+		for (size_t i: draw_order) {
+			if (cull_shapes && !shapes[i].is_occluder) {
+				if (!occluders_drawn) {
+					rasterizer->refresh_hierarchical_depth();
+					occluders_drawn = true;
+				}
+				if (!is_shape_visible(i)) {
+					culled_draws++;
+					continue;
+				}
+			}
+			draw_order[num_drawn++] = i;
+			const auto& index_buffer = settings->front_to_back ? sorted_index_buffers[i] : model->get_index_buffers()[i];
+			rasterizer->set_shading_rate(
+					settings->flat_shape_shading && shapes[i].is_flat ? shading_rate::rate_4x4 : shape_shading_rate);
+			rasterizer->set_vertex_buffer(model->get_vertex_buffers()[i]);
+			rasterizer->set_index_buffer(index_buffer);
+			rasterizer->draw(index_buffer->get_number_of_elements(), 0);
+		}
+		draw_order.resize(num_drawn);
 	};
 
-	for (size_t i = 0; i < model->get_index_buffers().size(); ++i) {
-		rasterizer->set_vertex_buffer(model->get_vertex_buffers()[i]);
-		rasterizer->set_index_buffer(model->get_index_buffers()[i]);
-		rasterizer->draw(model->get_vertex_buffers()[i]->get_number_of_elements(), 0);
+	rasterizer->reset_shaded_fragments();
+	if (settings->depth_prepass) {
+		// The color pass shades only the samples left by the depth pass
+		rasterizer->set_depth_only(true);
+		draw_shapes(settings->occlusion_culling);
+		rasterizer->set_depth_only(false);
+		rasterizer->set_depth_function(cg::renderer::depth_function::equal);
+		draw_shapes(false);
+		rasterizer->set_depth_function(cg::renderer::depth_function::less);
+	}
+	else {
+		draw_shapes(settings->occlusion_culling);
+	}
+	if (settings->deferred_shading) {
+		rasterizer->shade_visible_pixels();
+	}
+	if (settings->msaa) {
+		rasterizer->resolve_samples();
+	}
+	rasterizer->resolve_clears();
+	if (settings->adaptive_shading) {
+		// The next frame is shaded at the rates of this one
+		build_shading_rate_image();
 	}
 
-	utils::save_resource(*render_target, settings->result_path);
+	std::cout << static_cast<float>(rasterizer->get_shaded_fragments()) / (settings->width * settings->height)
+			  << " shaded fragments per pixel" << std::endl;
+	if (settings->occlusion_culling) {
+		std::cout << culled_draws << " draw calls culled by occlusion" << std::endl;
+	}
 }
\ No newline at end of file
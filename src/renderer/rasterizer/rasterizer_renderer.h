@@ -2,9 +2,153 @@
 #include "renderer/renderer.h"
 #include "resource.h"
 
+#include <algorithm>
+#include <cmath>
+#include <utility>
+#include <vector>
+
 
 namespace cg::renderer
 {
+	// Shaders of the renderer as types, so the rasterizer inlines them.
+	// The vertex data keeps the position and the normal in world space, the
+	// world matrix is expected to be a rigid transform
+	struct transform_vertex_shader
+	{
+		float4x4 matrix;
+		float4x4 world;
+
+		std::pair<float4, cg::vertex> operator()(float4 vertex, const cg::vertex& vertex_data) const
+		{
+			float4 position = mul(world, vertex);
+			float4 normal = mul(world, float4{vertex_data.nx, vertex_data.ny, vertex_data.nz, 0.f});
+			cg::vertex data = vertex_data;
+			data.x = position.x;
+			data.y = position.y;
+			data.z = position.z;
+			data.nx = normal.x;
+			data.ny = normal.y;
+			data.nz = normal.z;
+			return std::make_pair(mul(matrix, vertex), data);
+		}
+
+		// The same transform of simd::lanes vertices at once, the rasterizer
+		// calls it for the full batches of the vertex buffer
+		void operator()(const cg::vertex* vertices, std::pair<float4, cg::vertex>* out) const
+		{
+			constexpr size_t in_stride = sizeof(cg::vertex) / sizeof(float);
+			constexpr size_t out_stride = sizeof(std::pair<float4, cg::vertex>) / sizeof(float);
+			simd::float_v x = simd::load_strided(&vertices->x, in_stride);
+			simd::float_v y = simd::load_strided(&vertices->y, in_stride);
+			simd::float_v z = simd::load_strided(&vertices->z, in_stride);
+			simd::float_v nx = simd::load_strided(&vertices->nx, in_stride);
+			simd::float_v ny = simd::load_strided(&vertices->ny, in_stride);
+			simd::float_v nz = simd::load_strided(&vertices->nz, in_stride);
+			for (int lane = 0; lane < simd::lanes; ++lane) {
+				out[lane].second = vertices[lane];
+			}
+
+			for (int row = 0; row < 4; ++row) {
+				simd::float_v clip = simd::set(matrix.x[row]) * x + simd::set(matrix.y[row]) * y +
+									 simd::set(matrix.z[row]) * z + simd::set(matrix.w[row]);
+				simd::store_strided(&out->first[row], out_stride, clip);
+			}
+			float* positions[3] = {&out->second.x, &out->second.y, &out->second.z};
+			float* normals[3] = {&out->second.nx, &out->second.ny, &out->second.nz};
+			for (int row = 0; row < 3; ++row) {
+				simd::float_v position = simd::set(world.x[row]) * x + simd::set(world.y[row]) * y +
+										 simd::set(world.z[row]) * z + simd::set(world.w[row]);
+				simd::float_v normal = simd::set(world.x[row]) * nx + simd::set(world.y[row]) * ny +
+									   simd::set(world.z[row]) * nz;
+				simd::store_strided(positions[row], out_stride, position);
+				simd::store_strided(normals[row], out_stride, normal);
+			}
+		}
+	};
+
+	// Ambient color. With a shadow map the emissive color and the diffuse
+	// light of one light source are added, the world position and normal
+	// have to be varyings then
+	struct lit_pixel_shader
+	{
+		std::shared_ptr<cg::resource<float>> shadow_map;
+		int shadow_map_size = 0;
+		float4x4 light_matrix;
+		float3 light_position;
+		float3 light_direction;
+		float3 light_intensity;
+		// Emitters fall off with the cosine to their normal, a point light
+		// shines evenly
+		bool light_cosine = false;
+		// World size of a shadow map texel at a unit distance from the light
+		float texel_size = 0.f;
+		int pcf_radius = 1;
+		float3 camera_position;
+
+		// The lookup moves along the normal by a part of the texel size,
+		// the depth bias covers the rounding of the stored depths
+		static constexpr float normal_offset = 1.5f;
+		static constexpr float depth_bias = 1e-5f;
+		static constexpr float pi = 3.14159265358979f;
+
+		cg::color operator()(const cg::vertex& vertex_data, const float z) const
+		{
+			float3 result{vertex_data.ambient_r, vertex_data.ambient_g, vertex_data.ambient_b};
+			if (!shadow_map) {
+				return cg::color::from_float3(result);
+			}
+			result += float3{vertex_data.emissive_r, vertex_data.emissive_g, vertex_data.emissive_b};
+
+			// Normals face the viewer like in the raytracer
+			float3 position{vertex_data.x, vertex_data.y, vertex_data.z};
+			float3 normal = normalize(float3{vertex_data.nx, vertex_data.ny, vertex_data.nz});
+			if (dot(normal, camera_position - position) < 0.f) {
+				normal = -normal;
+			}
+
+			float3 to_light = light_position - position;
+			float distance = length(to_light);
+			float3 direction = to_light / distance;
+			float cos_surface = dot(normal, direction);
+			float cos_light = light_cosine ? -dot(light_direction, direction) : 1.f;
+			if (cos_surface <= 0.f || cos_light <= 0.f) {
+				return cg::color::from_float3(result);
+			}
+
+			float visibility = get_visibility(position + normal * (normal_offset * texel_size * distance));
+			float3 diffuse{vertex_data.diffuse_r, vertex_data.diffuse_g, vertex_data.diffuse_b};
+			result += diffuse / pi * light_intensity * (cos_light * cos_surface * visibility / (distance * distance));
+			return cg::color::from_float3(result);
+		}
+
+		// Percentage-closer filtering: the share of the (2 * pcf_radius + 1)^2
+		// texels around the position which do not occlude it. Positions out
+		// of the light frustum are lit
+		float get_visibility(const float3& position) const
+		{
+			float4 clip = mul(light_matrix, float4{position.x, position.y, position.z, 1.f});
+			if (clip.w <= 0.f) {
+				return 1.f;
+			}
+			float3 ndc{clip.x / clip.w, clip.y / clip.w, clip.z / clip.w};
+			if (std::abs(ndc.x) > 1.f || std::abs(ndc.y) > 1.f || ndc.z > 1.f) {
+				return 1.f;
+			}
+			int center_x = static_cast<int>((ndc.x + 1.f) * shadow_map_size / 2.f);
+			int center_y = static_cast<int>((-ndc.y + 1.f) * shadow_map_size / 2.f);
+			int lit = 0;
+			for (int dy = -pcf_radius; dy <= pcf_radius; ++dy) {
+				for (int dx = -pcf_radius; dx <= pcf_radius; ++dx) {
+					int x = std::clamp(center_x + dx, 0, shadow_map_size - 1);
+					int y = std::clamp(center_y + dy, 0, shadow_map_size - 1);
+					lit += ndc.z <= shadow_map->item(x, y) + depth_bias;
+				}
+			}
+			int side = 2 * pcf_radius + 1;
+			return static_cast<float>(lit) / static_cast<float>(side * side);
+		}
+	};
+
 	class rasterization_renderer : public renderer
 	{
 	public:
@@ -18,6 +162,66 @@ namespace cg::renderer
 		std::shared_ptr<cg::resource<cg::unsigned_color>> render_target;
 		std::shared_ptr<cg::resource<float>> depth_buffer;
 
-		std::shared_ptr<cg::renderer::rasterizer<cg::vertex, cg::unsigned_color>> rasterizer;
+		std::shared_ptr<cg::renderer::rasterizer<
+				cg::vertex, cg::unsigned_color, transform_vertex_shader, lit_pixel_shader>>
+				rasterizer;
+
+		// Depth-only draws from the light into the shadow map, without a
+		// render target. The light is the emissive triangles merged into one
+		// at their centroid or, for models without emitters, the point light
+		// of the raytracer looking down
+		std::shared_ptr<cg::renderer::rasterizer<
+				cg::vertex, cg::unsigned_color, transform_vertex_shader, lit_pixel_shader>>
+				shadow_rasterizer;
+		std::shared_ptr<cg::resource<float>> shadow_map;
+		static constexpr float shadow_angle_of_view = 2.0944f;
+
+		// Consecutive triangles of a shape and their bounds, computed at load
+		struct triangle_cluster
+		{
+			size_t shape_id;
+			size_t first_index;
+			size_t num_indices;
+			float3 bounds_min;
+			float3 bounds_max;
+			float depth;
+		};
+		static constexpr size_t cluster_size = 64;
+		std::vector<triangle_cluster> clusters;
+
+		// Index buffers with the clusters ordered front to back and the
+		// order of the shapes by their nearest cluster
+		std::vector<std::shared_ptr<cg::resource<unsigned int>>> sorted_index_buffers;
+		std::vector<size_t> shape_order;
+
+		// Bounds of the shapes. Occluders are the shapes whose diagonal is
+		// at least a quarter of the scene one, they are drawn first and the
+		// other shapes are tested against their depth. Flat shapes have the
+		// same material and normal at every vertex
+		struct shape_bounds
+		{
+			float3 bounds_min;
+			float3 bounds_max;
+			bool is_occluder;
+			bool is_flat;
+		};
+		static constexpr float occluder_size = 0.25f;
+		std::vector<shape_bounds> shapes;
+		std::vector<size_t> draw_order;
+
+		// Rate of the shapes which are not flat, and the rate image built
+		// from the contrast of the previous frame: blocks whose channels
+		// differ by at most the thresholds are shaded at 4x4 or 2x2
+		cg::renderer::shading_rate shape_shading_rate = cg::renderer::shading_rate::rate_1x1;
+		std::shared_ptr<cg::resource<cg::renderer::shading_rate>> shading_rate_image;
+		static constexpr int flat_contrast = 2;
+		static constexpr int smooth_contrast = 16;
+
+		void build_bounds();
+		void sort_front_to_back();
+		bool is_shape_visible(size_t shape_id) const;
+		void build_shading_rate_image();
+		void build_light();
+		void render_shadow_map();
 	};
 }// namespace cg::renderer
\ No newline at end of file
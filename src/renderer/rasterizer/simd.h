@@ -0,0 +1,247 @@
+#pragma once
+
+#include <cstddef>
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+
+// Thin wrappers over the widest available SIMD registers: 8 lanes with AVX2,
+// 4 lanes with SSE2 which every x64 CPU has
+namespace cg::renderer::simd
+{
+#ifdef __AVX2__
+	constexpr int lanes = 8;
+
+	struct float_v
+	{
+		__m256 value;
+	};
+
+	inline float_v set(float in_value)
+	{
+		return {_mm256_set1_ps(in_value)};
+	}
+
+	inline float_v lane_indices()
+	{
+		return {_mm256_setr_ps(0.f, 1.f, 2.f, 3.f, 4.f, 5.f, 6.f, 7.f)};
+	}
+
+	inline float_v operator+(float_v a, float_v b)
+	{
+		return {_mm256_add_ps(a.value, b.value)};
+	}
+
+	inline float_v operator*(float_v a, float_v b)
+	{
+		return {_mm256_mul_ps(a.value, b.value)};
+	}
+
+	inline float_v min(float_v a, float_v b)
+	{
+		return {_mm256_min_ps(a.value, b.value)};
+	}
+
+	inline float_v max(float_v a, float_v b)
+	{
+		return {_mm256_max_ps(a.value, b.value)};
+	}
+
+	inline float_v load(const float* in)
+	{
+		return {_mm256_loadu_ps(in)};
+	}
+
+	inline void store(float* out, float_v a)
+	{
+		_mm256_storeu_ps(out, a.value);
+	}
+
+	// Lanes of a where the bit of the mask is set, of b elsewhere
+	inline float_v blend(int mask, float_v a, float_v b)
+	{
+		__m256i bits = _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128);
+		__m256i selected = _mm256_cmpeq_epi32(_mm256_and_si256(_mm256_set1_epi32(mask), bits), bits);
+		return {_mm256_blendv_ps(b.value, a.value, _mm256_castsi256_ps(selected))};
+	}
+
+	struct int_v
+	{
+		__m256i value;
+	};
+
+	inline int_v set(int in_value)
+	{
+		return {_mm256_set1_epi32(in_value)};
+	}
+
+	// start, start + step, start + 2 * step, ...
+	inline int_v ramp(int start, int step)
+	{
+		return {_mm256_setr_epi32(
+				start, start + step, start + 2 * step, start + 3 * step,
+				start + 4 * step, start + 5 * step, start + 6 * step, start + 7 * step)};
+	}
+
+	// Rows of 4 values: start + (lane % 4) * step_x + (lane / 4) * step_y
+	inline int_v footprint(int start, int step_x, int step_y)
+	{
+		return {_mm256_setr_epi32(
+				start, start + step_x, start + 2 * step_x, start + 3 * step_x,
+				start + step_y, start + step_y + step_x, start + step_y + 2 * step_x, start + step_y + 3 * step_x)};
+	}
+
+	inline int_v operator+(int_v a, int_v b)
+	{
+		return {_mm256_add_epi32(a.value, b.value)};
+	}
+
+	// Bit per lane where all three values are not negative
+	inline int all_nonnegative(int_v a, int_v b, int_v c)
+	{
+		__m256i any_sign = _mm256_or_si256(_mm256_or_si256(a.value, b.value), c.value);
+		return ~_mm256_movemask_ps(_mm256_castsi256_ps(any_sign)) & 0xff;
+	}
+#else
+	constexpr int lanes = 4;
+
+	struct float_v
+	{
+		__m128 value;
+	};
+
+	inline float_v set(float in_value)
+	{
+		return {_mm_set1_ps(in_value)};
+	}
+
+	inline float_v lane_indices()
+	{
+		return {_mm_setr_ps(0.f, 1.f, 2.f, 3.f)};
+	}
+
+	inline float_v operator+(float_v a, float_v b)
+	{
+		return {_mm_add_ps(a.value, b.value)};
+	}
+
+	inline float_v operator*(float_v a, float_v b)
+	{
+		return {_mm_mul_ps(a.value, b.value)};
+	}
+
+	inline float_v min(float_v a, float_v b)
+	{
+		return {_mm_min_ps(a.value, b.value)};
+	}
+
+	inline float_v max(float_v a, float_v b)
+	{
+		return {_mm_max_ps(a.value, b.value)};
+	}
+
+	inline float_v load(const float* in)
+	{
+		return {_mm_loadu_ps(in)};
+	}
+
+	inline void store(float* out, float_v a)
+	{
+		_mm_storeu_ps(out, a.value);
+	}
+
+	// Lanes of a where the bit of the mask is set, of b elsewhere
+	inline float_v blend(int mask, float_v a, float_v b)
+	{
+		__m128i bits = _mm_setr_epi32(1, 2, 4, 8);
+		__m128 selected = _mm_castsi128_ps(_mm_cmpeq_epi32(_mm_and_si128(_mm_set1_epi32(mask), bits), bits));
+		return {_mm_or_ps(_mm_and_ps(selected, a.value), _mm_andnot_ps(selected, b.value))};
+	}
+
+	struct int_v
+	{
+		__m128i value;
+	};
+
+	inline int_v set(int in_value)
+	{
+		return {_mm_set1_epi32(in_value)};
+	}
+
+	// start, start + step, start + 2 * step, ...
+	inline int_v ramp(int start, int step)
+	{
+		return {_mm_setr_epi32(start, start + step, start + 2 * step, start + 3 * step)};
+	}
+
+	// Rows of 4 values: start + (lane % 4) * step_x + (lane / 4) * step_y
+	inline int_v footprint(int start, int step_x, int step_y)
+	{
+		return ramp(start, step_x);
+	}
+
+	inline int_v operator+(int_v a, int_v b)
+	{
+		return {_mm_add_epi32(a.value, b.value)};
+	}
+
+	// Bit per lane where all three values are not negative
+	inline int all_nonnegative(int_v a, int_v b, int_v c)
+	{
+		__m128i any_sign = _mm_or_si128(_mm_or_si128(a.value, b.value), c.value);
+		return ~_mm_movemask_ps(_mm_castsi128_ps(any_sign)) & 0xf;
+	}
+#endif
+
+	inline float_v& operator+=(float_v& a, float_v b)
+	{
+		a = a + b;
+		return a;
+	}
+
+	inline int_v& operator+=(int_v& a, int_v b)
+	{
+		a = a + b;
+		return a;
+	}
+
+	// Lanes from every stride-th float, e.g. one member of an array of
+	// structures
+	inline float_v load_strided(const float* in, size_t stride)
+	{
+		alignas(32) float values[lanes];
+		for (int lane = 0; lane < lanes; ++lane) {
+			values[lane] = in[lane * stride];
+		}
+		return load(values);
+	}
+
+	inline void store_strided(float* out, size_t stride, float_v a)
+	{
+		alignas(32) float values[lanes];
+		store(values, a);
+		for (int lane = 0; lane < lanes; ++lane) {
+			out[lane * stride] = values[lane];
+		}
+	}
+
+	// Bits of the first count lanes
+	inline int first_lanes(int count)
+	{
+		return count >= lanes ? (1 << lanes) - 1 : (1 << count) - 1;
+	}
+
+	// Index of the lowest set bit of a non-zero mask
+	inline int lowest_lane(int mask)
+	{
+#ifdef _MSC_VER
+		unsigned long index;
+		_BitScanForward(&index, static_cast<unsigned long>(mask));
+		return static_cast<int>(index);
+#else
+		return __builtin_ctz(static_cast<unsigned int>(mask));
+#endif
+	}
+}// namespace cg::renderer::simd
@@ -0,0 +1,434 @@
+#pragma once
+
+#include "resource.h"
+
+#include <algorithm>
+#include <linalg.h>
+#include <numeric>
+#include <vector>
+
+
+using namespace linalg::aliases;
+
+namespace cg::renderer
+{
+	constexpr float pi = 3.14159265358979f;
+
+	struct light
+	{
+		float3 position;
+		float3 color;
+	};
+
+	inline float luminance(const float3& color)
+	{
+		return dot(color, float3{0.2126f, 0.7152f, 0.0722f});
+	}
+
+	struct light_sample
+	{
+		float3 position;
+		float3 direction;
+		float distance;
+		// Radiance arriving at the shading point, already multiplied by
+		// the geometry term and divided by the pdf of the sampled position
+		float3 incident;
+	};
+
+	// A light source that can be picked by a light sampler: either a point
+	// light or an emissive triangle of the scene
+	struct emitter
+	{
+		static emitter from_light(const light& in_light);
+		template<typename TRIANGLE>
+		static emitter from_triangle(const TRIANGLE& in_triangle);
+
+		float power() const;
+		light_sample sample(const float3& shading_point, float2 u) const;
+
+		bool is_point;
+		float3 position;
+		float3 ba;
+		float3 ca;
+		float3 normal;
+		float area;
+		// Intensity for point lights, emitted radiance for triangles
+		float3 emission;
+	};
+
+	// Walker's alias method: O(n) construction, O(1) sampling of an index
+	// proportionally to its weight
+	class alias_table
+	{
+	public:
+		void build(const std::vector<float>& weights);
+		size_t sample(float u, float& pdf) const;
+		float pdf(size_t index) const;
+		bool empty() const;
+
+	protected:
+		std::vector<float> probabilities;
+		std::vector<size_t> aliases;
+		std::vector<float> pdfs;
+	};
+
+	// Bounding cone of emission directions: every emitter below a node emits
+	// around axis within theta_o, and each emitting normal spreads its light
+	// up to theta_e further
+	struct light_cone
+	{
+		static light_cone merge(const light_cone& a, const light_cone& b);
+
+		float3 axis;
+		float theta_o;
+		float theta_e;
+	};
+
+	// Light BVH over emitters. Traversal picks a child proportionally to a
+	// conservative estimate of its contribution to the shading point, so the
+	// selected light is likely to matter whatever the number of emitters is
+	class light_tree
+	{
+	public:
+		void build(const std::vector<emitter>& in_emitters);
+		// Returns an index of the selected emitter or -1 if no emitter can
+		// light the shading point
+		int sample(const float3& position, const float3& normal, float u, float& pdf) const;
+		bool empty() const;
+
+	protected:
+		struct node
+		{
+			float3 bounds_min;
+			float3 bounds_max;
+			light_cone cone;
+			float power;
+			// Index of the second child for inner nodes, the first child
+			// always follows its parent
+			int right_child;
+			// Index of the emitter for leaves, -1 for inner nodes
+			int emitter_id;
+		};
+
+		int build_node(const std::vector<emitter>& in_emitters, std::vector<int>& ids, size_t begin, size_t end);
+		float importance(const node& node, const float3& position, const float3& normal) const;
+
+		std::vector<node> nodes;
+	};
+
+	inline emitter emitter::from_light(const light& in_light)
+	{
+		emitter result{};
+		result.is_point = true;
+		result.position = in_light.position;
+		result.emission = in_light.color;
+		return result;
+	}
+
+	template<typename TRIANGLE>
+	inline emitter emitter::from_triangle(const TRIANGLE& in_triangle)
+	{
+		emitter result{};
+		result.is_point = false;
+		result.position = in_triangle.a;
+		result.ba = in_triangle.ba;
+		result.ca = in_triangle.ca;
+
+		float3 geometric_normal = cross(in_triangle.ba, in_triangle.ca);
+		result.area = length(geometric_normal) / 2.f;
+		result.normal = normalize(geometric_normal);
+		// Emit to the side the shading normals are facing
+		if (dot(result.normal, in_triangle.na + in_triangle.nb + in_triangle.nc) < 0.f) {
+			result.normal = -result.normal;
+		}
+		result.emission = in_triangle.emissive;
+		return result;
+	}
+
+	inline float emitter::power() const
+	{
+		if (is_point) {
+			return 4.f * pi * luminance(emission);
+		}
+		return pi * area * luminance(emission);
+	}
+
+	inline light_sample emitter::sample(const float3& shading_point, float2 u) const
+	{
+		light_sample result{};
+		if (is_point) {
+			result.position = position;
+		}
+		else {
+			// Uniform point on the triangle
+			if (u.x + u.y > 1.f) {
+				u = float2{1.f - u.x, 1.f - u.y};
+			}
+			result.position = position + u.x * ba + u.y * ca;
+		}
+
+		float3 to_light = result.position - shading_point;
+		float distance_squared = dot(to_light, to_light);
+		result.distance = std::sqrt(distance_squared);
+		result.direction = to_light / result.distance;
+
+		if (is_point) {
+			result.incident = emission / distance_squared;
+		}
+		else {
+			float cos_light = std::max(-dot(normal, result.direction), 0.f);
+			result.incident = emission * (cos_light * area / distance_squared);
+		}
+		return result;
+	}
+
+	inline void alias_table::build(const std::vector<float>& weights)
+	{
+		size_t count = weights.size();
+		probabilities.assign(count, 1.f);
+		aliases.resize(count);
+		pdfs.assign(count, 0.f);
+
+		float total = 0.f;
+		for (float weight: weights) {
+			total += weight;
+		}
+		if (count == 0 || total <= 0.f) {
+			for (size_t i = 0; i < count; ++i) {
+				aliases[i] = i;
+				pdfs[i] = 1.f / count;
+			}
+			return;
+		}
+
+		std::vector<size_t> small;
+		std::vector<size_t> large;
+		std::vector<float> scaled(count);
+		for (size_t i = 0; i < count; ++i) {
+			pdfs[i] = weights[i] / total;
+			scaled[i] = pdfs[i] * count;
+			aliases[i] = i;
+			if (scaled[i] < 1.f)
+				small.push_back(i);
+			else
+				large.push_back(i);
+		}
+
+		while (!small.empty() && !large.empty()) {
+			size_t less = small.back();
+			small.pop_back();
+			size_t more = large.back();
+
+			probabilities[less] = scaled[less];
+			aliases[less] = more;
+
+			scaled[more] = (scaled[more] + scaled[less]) - 1.f;
+			if (scaled[more] < 1.f) {
+				large.pop_back();
+				small.push_back(more);
+			}
+		}
+		// Leftovers are 1 up to the rounding errors
+		for (size_t i: small) {
+			probabilities[i] = 1.f;
+		}
+		for (size_t i: large) {
+			probabilities[i] = 1.f;
+		}
+	}
+
+	inline size_t alias_table::sample(float u, float& pdf) const
+	{
+		float scaled = u * probabilities.size();
+		size_t index = std::min(static_cast<size_t>(scaled), probabilities.size() - 1);
+		float remainder = scaled - index;
+
+		if (remainder >= probabilities[index]) {
+			index = aliases[index];
+		}
+		pdf = pdfs[index];
+		return index;
+	}
+
+	inline float alias_table::pdf(size_t index) const
+	{
+		return pdfs[index];
+	}
+
+	inline bool alias_table::empty() const
+	{
+		return probabilities.empty();
+	}
+
+	inline light_cone light_cone::merge(const light_cone& a, const light_cone& b)
+	{
+		if (a.theta_o < b.theta_o) {
+			return merge(b, a);
+		}
+
+		float theta_d = std::acos(std::clamp(dot(a.axis, b.axis), -1.f, 1.f));
+		float theta_e = std::max(a.theta_e, b.theta_e);
+		if (std::min(theta_d + b.theta_o, pi) <= a.theta_o) {
+			return light_cone{a.axis, a.theta_o, theta_e};
+		}
+
+		float theta_o = (a.theta_o + theta_d + b.theta_o) / 2.f;
+		if (theta_o >= pi) {
+			return light_cone{a.axis, pi, theta_e};
+		}
+
+		// Rotate the axis of a towards b to the middle of the merged cone
+		float3 ortho = b.axis - a.axis * dot(a.axis, b.axis);
+		if (dot(ortho, ortho) < 1e-12f) {
+			return light_cone{a.axis, theta_o, theta_e};
+		}
+		float theta_r = theta_o - a.theta_o;
+		float3 axis = a.axis * std::cos(theta_r) + normalize(ortho) * std::sin(theta_r);
+		return light_cone{normalize(axis), theta_o, theta_e};
+	}
+
+	inline void light_tree::build(const std::vector<emitter>& in_emitters)
+	{
+		nodes.clear();
+		if (in_emitters.empty()) {
+			return;
+		}
+		nodes.reserve(2 * in_emitters.size());
+
+		std::vector<int> ids(in_emitters.size());
+		std::iota(ids.begin(), ids.end(), 0);
+		build_node(in_emitters, ids, 0, ids.size());
+	}
+
+	inline int light_tree::build_node(const std::vector<emitter>& in_emitters, std::vector<int>& ids, size_t begin, size_t end)
+	{
+		int node_id = static_cast<int>(nodes.size());
+		nodes.emplace_back();
+
+		if (end - begin == 1) {
+			const emitter& leaf = in_emitters[ids[begin]];
+			node result{};
+			result.bounds_min = result.bounds_max = leaf.position;
+			if (leaf.is_point) {
+				result.cone = light_cone{float3{0.f, 0.f, 1.f}, pi, pi / 2.f};
+			}
+			else {
+				result.bounds_min = min(result.bounds_min, min(leaf.position + leaf.ba, leaf.position + leaf.ca));
+				result.bounds_max = max(result.bounds_max, max(leaf.position + leaf.ba, leaf.position + leaf.ca));
+				result.cone = light_cone{leaf.normal, 0.f, pi / 2.f};
+			}
+			result.power = leaf.power();
+			result.right_child = -1;
+			result.emitter_id = ids[begin];
+			nodes[node_id] = result;
+			return node_id;
+		}
+
+		// Split at the middle of the longest axis of the centroid bounds
+		auto centroid = [&](int id) {
+			const emitter& e = in_emitters[id];
+			return e.is_point ? e.position : e.position + (e.ba + e.ca) / 3.f;
+		};
+		float3 centroid_min = centroid(ids[begin]);
+		float3 centroid_max = centroid_min;
+		for (size_t i = begin + 1; i < end; ++i) {
+			centroid_min = min(centroid_min, centroid(ids[i]));
+			centroid_max = max(centroid_max, centroid(ids[i]));
+		}
+		float3 extent = centroid_max - centroid_min;
+		int axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+		float split = (centroid_min[axis] + centroid_max[axis]) / 2.f;
+
+		auto middle = std::partition(ids.begin() + begin, ids.begin() + end, [&](int id) {
+			return centroid(id)[axis] < split;
+		});
+		size_t middle_id = middle - ids.begin();
+		if (middle_id == begin || middle_id == end) {
+			// All centroids coincide, fall back to a median split
+			middle_id = (begin + end) / 2;
+		}
+
+		int left_child = build_node(in_emitters, ids, begin, middle_id);
+		int right_child = build_node(in_emitters, ids, middle_id, end);
+		const node& left = nodes[left_child];
+		const node& right = nodes[right_child];
+
+		node result{};
+		result.bounds_min = min(left.bounds_min, right.bounds_min);
+		result.bounds_max = max(left.bounds_max, right.bounds_max);
+		result.cone = light_cone::merge(left.cone, right.cone);
+		result.power = left.power + right.power;
+		result.right_child = right_child;
+		result.emitter_id = -1;
+		nodes[node_id] = result;
+		return node_id;
+	}
+
+	inline float light_tree::importance(const node& node, const float3& position, const float3& normal) const
+	{
+		float3 center = (node.bounds_min + node.bounds_max) / 2.f;
+		float3 to_center = center - position;
+		float radius_squared = dot(node.bounds_max - center, node.bounds_max - center);
+		// Clamp the distance to the node size so the estimate does not
+		// explode for shading points close to or inside the node. A point
+		// light has no size, a small minimum keeps its importance finite
+		float distance_squared = std::max({dot(to_center, to_center), radius_squared, 1e-6f});
+		float distance = std::sqrt(distance_squared);
+		float3 direction = to_center / std::max(distance, 1e-6f);
+
+		bool inside = dot(to_center, to_center) <= radius_squared;
+		float theta_u = inside ? pi : std::asin(std::min(std::sqrt(radius_squared) / distance, 1.f));
+
+		// Angle between the emission cone and the direction to the shading point
+		float theta = std::acos(std::clamp(-dot(node.cone.axis, direction), -1.f, 1.f));
+		float theta_prime = std::max(theta - node.cone.theta_o - theta_u, 0.f);
+		if (theta_prime >= node.cone.theta_e) {
+			return 0.f;
+		}
+
+		// Angle of incidence at the shading point
+		float theta_i = std::acos(std::clamp(dot(normal, direction), -1.f, 1.f));
+		float theta_i_prime = std::max(theta_i - theta_u, 0.f);
+		if (theta_i_prime >= pi / 2.f) {
+			return 0.f;
+		}
+
+		return node.power * std::cos(theta_prime) * std::cos(theta_i_prime) / distance_squared;
+	}
+
+	inline int light_tree::sample(const float3& position, const float3& normal, float u, float& pdf) const
+	{
+		pdf = 1.f;
+		int node_id = 0;
+		while (nodes[node_id].emitter_id < 0) {
+			int left_child = node_id + 1;
+			int right_child = nodes[node_id].right_child;
+			float left_importance = importance(nodes[left_child], position, normal);
+			float right_importance = importance(nodes[right_child], position, normal);
+			float total = left_importance + right_importance;
+			if (total <= 0.f) {
+				return -1;
+			}
+
+			float left_probability = left_importance / total;
+			if (u < left_probability) {
+				// Reuse the random number for the next level
+				u = u / left_probability;
+				pdf *= left_probability;
+				node_id = left_child;
+			}
+			else {
+				u = (u - left_probability) / (1.f - left_probability);
+				pdf *= 1.f - left_probability;
+				node_id = right_child;
+			}
+			u = std::min(u, 0.99999994f);
+		}
+		return nodes[node_id].emitter_id;
+	}
+
+	inline bool light_tree::empty() const
+	{
+		return nodes.empty();
+	}
+}// namespace cg::renderer
@@ -1,17 +1,28 @@
 #pragma once
 
+#include "renderer/raytracer/light_sampling.h"
 #include "resource.h"
 
+#include <array>
+#include <functional>
 #include <iostream>
 #include <linalg.h>
 #include <memory>
 #include <omp.h>
 #include <random>
+#include <type_traits>
 
 using namespace linalg::aliases;
 
 namespace cg::renderer
 {
+	inline float random_float()
+	{
+		thread_local std::mt19937 generator{std::random_device{}()};
+		thread_local std::uniform_real_distribution<float> distribution(0.f, 1.f);
+		return distribution(generator);
+	}
+
 	struct ray
 	{
 		ray(float3 position, float3 direction) : position(position)
@@ -20,8 +31,29 @@ namespace cg::renderer
 		}
 		float3 position;
 		float3 direction;
+		// Path state: product of the BRDF weights so far and the number of
+		// bounces before this ray
+		float3 throughput{1.f, 1.f, 1.f};
+		unsigned bounce = 0;
 	};
 
+	// Cosine weighted direction around the normal, pdf is cos(theta) / pi
+	inline float3 sample_cosine_hemisphere(const float3& normal, float2 u)
+	{
+		float radius = std::sqrt(u.x);
+		float phi = 2.f * pi * u.y;
+		float3 local{radius * std::cos(phi), radius * std::sin(phi), std::sqrt(std::max(1.f - u.x, 0.f))};
+
+		// Orthonormal basis without branches on the normal direction
+		float sign = std::copysign(1.f, normal.z);
+		float a = -1.f / (sign + normal.z);
+		float b = normal.x * normal.y * a;
+		float3 tangent{1.f + sign * normal.x * normal.x * a, sign * b, -sign * normal.x};
+		float3 bitangent{b, sign + normal.y * normal.y * a, -normal.y};
+
+		return local.x * tangent + local.y * bitangent + local.z * normal;
+	}
+
 	struct payload
 	{
 		float t;
@@ -29,6 +61,16 @@ namespace cg::renderer
 		cg::color color;
 	};
 
+	// Closest intersection found by traversal. Position and normal follow from
+	// t and the barycentrics, the triangle id identifies the material
+	struct hit_record
+	{
+		float t;
+		float3 bary;
+		int shape_id = -1;
+		int triangle_id = -1;
+	};
+
 	template<typename VB>
 	struct triangle
 	{
@@ -85,13 +127,31 @@ namespace cg::renderer
 		float3 aabb_max;
 	};
 
-	struct light
+	// Default shader types: any callable bound at run time. Functor types
+	// given as the template parameters are called directly and inlined,
+	// they have to be default constructible
+	using miss_shader_function = std::function<payload(const ray& ray)>;
+	template<typename VB>
+	using closest_hit_shader_function =
+			std::function<payload(const ray& ray, payload& payload, const triangle<VB>& triangle, size_t depth)>;
+	template<typename VB>
+	using any_hit_shader_function =
+			std::function<payload(const ray& ray, payload& payload, const triangle<VB>& triangle)>;
+
+	// An empty std::function is an unbound shader, a functor is always bound
+	template<typename S>
+	inline bool is_bound(const S& shader)
 	{
-		float3 position;
-		float3 color;
-	};
+		if constexpr (std::is_constructible_v<bool, const S&>) {
+			return static_cast<bool>(shader);
+		}
+		else {
+			return true;
+		}
+	}
 
-	template<typename VB, typename RT>
+	template<typename VB, typename RT, typename MS = miss_shader_function,
+			 typename CHS = closest_hit_shader_function<VB>, typename AHS = any_hit_shader_function<VB>>
 	class raytracer
 	{
 	public:
@@ -111,12 +171,22 @@ namespace cg::renderer
 
 		payload trace_ray(const ray& ray, size_t depth, float max_t = 1000.f, float min_t = 0.001f) const;
 		payload intersection_shader(const triangle<VB>& triangle, const ray& ray) const;
+		hit_record find_closest_hit(const ray& ray, float max_t = 1000.f, float min_t = 0.001f) const;
+		payload shade_hit(const ray& ray, const hit_record& hit, size_t depth) const;
 
-		std::function<payload(const ray& ray)> miss_shader = nullptr;
-		std::function<payload(const ray& ray, payload& payload, const triangle<VB>& triangle, size_t depth)>
-				closest_hit_shader = nullptr;
-		std::function<payload(const ray& ray, payload& payload, const triangle<VB>& triangle)> any_hit_shader =
-				nullptr;
+		// Keeps one primary hit per pixel, so that renders from the same
+		// camera only run the hit shaders. The accumulation frames then all
+		// sample the pixel at the position of the first one
+		void set_primary_hit_cache(bool in_enabled);
+		void invalidate_primary_hit_cache();
+
+		// Keeps the accumulated history between ray_generation calls and
+		// reprojects it to the new camera instead of starting from scratch
+		void set_temporal_reprojection(bool in_enabled, size_t in_max_history_length = 64);
+
+		MS miss_shader{};
+		CHS closest_hit_shader{};
+		AHS any_hit_shader{};
 
 		float2 get_jitter(int frame_id);
 
@@ -128,40 +198,71 @@ namespace cg::renderer
 
 		size_t width = 1920;
 		size_t height = 1080;
+
+		bool primary_hit_cache_enabled = false;
+		std::vector<hit_record> primary_hits;
+		std::array<float3, 4> primary_hits_camera;
+
+		void allocate_temporal_buffers();
+		bool reproject(const ray& ray, const hit_record& hit, float3& color, float& sample_count) const;
+
+		bool temporal_reprojection_enabled = false;
+		bool temporal_history_valid = false;
+		float max_history_length = 64.f;
+		std::array<float3, 4> history_camera;
+		// Distance to the primary hit, negative for misses
+		std::shared_ptr<cg::resource<float>> history_depth;
+		// Number of samples accumulated in the pixel
+		std::shared_ptr<cg::resource<float>> history_length;
+		std::shared_ptr<cg::resource<float3>> previous_history;
+		std::shared_ptr<cg::resource<float>> previous_depth;
+		std::shared_ptr<cg::resource<float>> previous_length;
 	};
 
-	template<typename VB, typename RT>
-	inline void raytracer<VB, RT>::set_render_target(
+	template<typename VB, typename RT, typename MS, typename CHS, typename AHS>
+	inline void raytracer<VB, RT, MS, CHS, AHS>::set_render_target(
 			std::shared_ptr<resource<RT>> in_render_target)
 	{
 		render_target = in_render_target;
 	}
 
-	template<typename VB, typename RT>
-	inline void raytracer<VB, RT>::clear_render_target(const RT& in_clear_value)
+	template<typename VB, typename RT, typename MS, typename CHS, typename AHS>
+	inline void raytracer<VB, RT, MS, CHS, AHS>::clear_render_target(const RT& in_clear_value)
 	{
-		for (size_t i = 0; i < render_target->get_number_of_elements(); ++i) {
-			render_target->item(i) = in_clear_value;
-			if (history){
-				history->item(i) = float3{.0f, .0f, .0f};
+		// The temporal history outlives clears, it is reprojected instead
+		bool clear_history = history && !temporal_reprojection_enabled;
+
+		// Threads fill contiguous chunks
+		constexpr size_t chunk_size = 1 << 16;
+		size_t num_elements = render_target->get_number_of_elements();
+		int num_chunks = static_cast<int>((num_elements + chunk_size - 1) / chunk_size);
+#pragma omp parallel for schedule(static)
+		for (int chunk = 0; chunk < num_chunks; ++chunk) {
+			size_t begin = chunk * chunk_size;
+			size_t end = std::min(begin + chunk_size, num_elements);
+			render_target->fill(in_clear_value, begin, end);
+			if (clear_history) {
+				history->fill(float3{.0f, .0f, .0f}, begin, end);
 			}
 		}
 	}
 
-	template<typename VB, typename RT>
-	void raytracer<VB, RT>::set_index_buffers(std::vector<std::shared_ptr<cg::resource<unsigned int>>> in_index_buffers)
+	template<typename VB, typename RT, typename MS, typename CHS, typename AHS>
+	void raytracer<VB, RT, MS, CHS, AHS>::set_index_buffers(std::vector<std::shared_ptr<cg::resource<unsigned int>>> in_index_buffers)
 	{
 		index_buffers = in_index_buffers;
 	}
-	template<typename VB, typename RT>
-	inline void raytracer<VB, RT>::set_vertex_buffers(std::vector<std::shared_ptr<cg::resource<VB>>> in_vertex_buffers)
+	template<typename VB, typename RT, typename MS, typename CHS, typename AHS>
+	inline void raytracer<VB, RT, MS, CHS, AHS>::set_vertex_buffers(std::vector<std::shared_ptr<cg::resource<VB>>> in_vertex_buffers)
 	{
 		vertex_buffers = in_vertex_buffers;
 	}
 
-	template<typename VB, typename RT>
-	inline void raytracer<VB, RT>::build_acceleration_structure()
+	template<typename VB, typename RT, typename MS, typename CHS, typename AHS>
+	inline void raytracer<VB, RT, MS, CHS, AHS>::build_acceleration_structure()
 	{
+		acceleration_structures.clear();
+		invalidate_primary_hit_cache();
 		for (size_t shape_id = 0; shape_id < index_buffers.size(); ++shape_id) {
 			auto& index_buffer = index_buffers[shape_id];
 			auto& vertex_buffer = vertex_buffers[shape_id];
@@ -179,19 +280,77 @@ namespace cg::renderer
 		}
 	}
 
-	template<typename VB, typename RT>
-	inline void raytracer<VB, RT>::set_viewport(size_t in_width, size_t in_height)
+	template<typename VB, typename RT, typename MS, typename CHS, typename AHS>
+	inline void raytracer<VB, RT, MS, CHS, AHS>::set_viewport(size_t in_width, size_t in_height)
 	{
 		width = in_width;
 		height = in_height;
 		history = std::make_shared<cg::resource<float3>>(width, height);
+		invalidate_primary_hit_cache();
+		if (temporal_reprojection_enabled) {
+			allocate_temporal_buffers();
+		}
+	}
+
+	template<typename VB, typename RT, typename MS, typename CHS, typename AHS>
+	inline void raytracer<VB, RT, MS, CHS, AHS>::set_primary_hit_cache(bool in_enabled)
+	{
+		primary_hit_cache_enabled = in_enabled;
+		invalidate_primary_hit_cache();
+	}
+
+	template<typename VB, typename RT, typename MS, typename CHS, typename AHS>
+	inline void raytracer<VB, RT, MS, CHS, AHS>::invalidate_primary_hit_cache()
+	{
+		primary_hits.clear();
+	}
+
+	template<typename VB, typename RT, typename MS, typename CHS, typename AHS>
+	inline void raytracer<VB, RT, MS, CHS, AHS>::set_temporal_reprojection(bool in_enabled, size_t in_max_history_length)
+	{
+		temporal_reprojection_enabled = in_enabled;
+		max_history_length = static_cast<float>(std::max<size_t>(in_max_history_length, 1));
+		if (temporal_reprojection_enabled) {
+			allocate_temporal_buffers();
+		}
 	}
 
-	template<typename VB, typename RT>
-	inline void raytracer<VB, RT>::ray_generation(float3 position, float3 direction, float3 right, float3 up, size_t depth, size_t accumulation_num)
+	template<typename VB, typename RT, typename MS, typename CHS, typename AHS>
+	inline void raytracer<VB, RT, MS, CHS, AHS>::allocate_temporal_buffers()
 	{
+		history_depth = std::make_shared<cg::resource<float>>(width, height);
+		history_length = std::make_shared<cg::resource<float>>(width, height);
+		previous_history = std::make_shared<cg::resource<float3>>(width, height);
+		previous_depth = std::make_shared<cg::resource<float>>(width, height);
+		previous_length = std::make_shared<cg::resource<float>>(width, height);
+		temporal_history_valid = false;
+	}
+
+	template<typename VB, typename RT, typename MS, typename CHS, typename AHS>
+	inline void raytracer<VB, RT, MS, CHS, AHS>::ray_generation(float3 position, float3 direction, float3 right, float3 up, size_t depth, size_t accumulation_num)
+	{
+		// Cached hits stay valid while the camera does not change
+		bool use_cache = primary_hit_cache_enabled && depth > 0;
+		std::array<float3, 4> camera{position, direction, right, up};
+		bool cache_valid = use_cache &&
+						   primary_hits.size() == width * height &&
+						   primary_hits_camera == camera;
+		if (use_cache && !cache_valid) {
+			primary_hits.assign(width * height, hit_record{});
+			primary_hits_camera = camera;
+		}
+
+		// The history of the last call becomes the source of the reprojection
+		bool temporal = temporal_reprojection_enabled;
+		bool reprojection = temporal && temporal_history_valid;
+		if (temporal) {
+			std::swap(history, previous_history);
+			std::swap(history_depth, previous_depth);
+			std::swap(history_length, previous_length);
+		}
+
 		for (int frame_id = 0; frame_id < accumulation_num; ++frame_id) {
-			auto jitter = get_jitter(frame_id);
+			auto jitter = get_jitter(use_cache ? 0 : frame_id);
 			float frame_weight = 1.f / float(accumulation_num);
 
 			for (int x = 0; x < width; ++x)
@@ -205,58 +364,160 @@ namespace cg::renderer
 					float3 ray_direction{direction + u * right - v * up};
 					ray r{position, ray_direction};
 
-					auto trace_result = trace_ray(r, depth);
+					hit_record hit;
+					if (use_cache) {
+						hit = primary_hits[y * width + x];
+						if (!cache_valid && frame_id == 0) {
+							hit = find_closest_hit(r);
+							primary_hits[y * width + x] = hit;
+						}
+					}
+					else if (depth > 0) {
+						hit = find_closest_hit(r);
+					}
+					payload trace_result = depth > 0 ? shade_hit(r, hit, depth - 1) : miss_shader(r);
+					float3 sample{trace_result.color.r, trace_result.color.g, trace_result.color.b};
+
 					auto& history_pixel = history->item(x, y);
-					history_pixel += float3{trace_result.color.r, trace_result.color.g, trace_result.color.b} * frame_weight;
+					if (temporal) {
+						auto& sample_count = history_length->item(x, y);
+						if (frame_id == 0) {
+							// Disoccluded pixels restart the accumulation
+							if (!reprojection || !reproject(r, hit, history_pixel, sample_count)) {
+								history_pixel = float3{.0f, .0f, .0f};
+								sample_count = 0.f;
+							}
+						}
+						sample_count = std::min(sample_count + 1.f, max_history_length);
+						history_pixel += (sample - history_pixel) / sample_count;
+						history_depth->item(x, y) = hit.shape_id < 0 ? -1.f : hit.t;
+					}
+					else {
+						history_pixel += sample * frame_weight;
+					}
 
-					render_target->item(x, y) = RT::from_color(history_pixel);
+					render_target->item(x, y) = RT::from_float3(history_pixel);
 				}
 			}
 		}
+
+		if (temporal) {
+			temporal_history_valid = true;
+			history_camera = camera;
+		}
 	}
 
-	template<typename VB, typename RT>
-	inline payload raytracer<VB, RT>::trace_ray(
+	template<typename VB, typename RT, typename MS, typename CHS, typename AHS>
+	inline bool raytracer<VB, RT, MS, CHS, AHS>::reproject(
+			const ray& ray, const hit_record& hit, float3& color, float& sample_count) const
+	{
+		const auto& [old_position, old_direction, old_right, old_up] = history_camera;
+
+		// Misses are reprojected as directions, hits as points
+		bool is_hit = hit.shape_id >= 0;
+		float3 offset = is_hit ? ray.position + ray.direction * hit.t - old_position : ray.direction;
+
+		// Invert the ray generation of the old camera
+		float forward = dot(offset, old_direction) / dot(old_direction, old_direction);
+		if (forward <= 0.f) {
+			return false;
+		}
+		float u = dot(offset, old_right) / (dot(old_right, old_right) * forward);
+		float v = -dot(offset, old_up) / (dot(old_up, old_up) * forward);
+		u /= float(width) / float(height);
+
+		float x = std::round((u + 1.f) * (width - 1.f) / 2.f);
+		float y = std::round((v + 1.f) * (height - 1.f) / 2.f);
+		if (x < 0.f || y < 0.f || x > width - 1.f || y > height - 1.f) {
+			return false;
+		}
+
+		size_t old_x = static_cast<size_t>(x);
+		size_t old_y = static_cast<size_t>(y);
+		float old_depth = previous_depth->item(old_x, old_y);
+		if (is_hit) {
+			// A different distance means the point was occluded in the old view
+			float expected_depth = length(offset);
+			if (old_depth < 0.f || std::abs(old_depth - expected_depth) > 0.02f * expected_depth) {
+				return false;
+			}
+		}
+		else if (old_depth >= 0.f) {
+			return false;
+		}
+
+		color = previous_history->item(old_x, old_y);
+		sample_count = previous_length->item(old_x, old_y);
+		return true;
+	}
+
+	template<typename VB, typename RT, typename MS, typename CHS, typename AHS>
+	inline payload raytracer<VB, RT, MS, CHS, AHS>::trace_ray(
 			const ray& ray, size_t depth, float max_t, float min_t) const
 	{
 		if (depth-- == 0) {
 			return miss_shader(ray);
 		}
 
-		bool anyHit = false;
-		payload closest_hit;
-		const triangle<VB>* closest_hit_triangle;
+		return shade_hit(ray, find_closest_hit(ray, max_t, min_t), depth);
+	}
+
+	template<typename VB, typename RT, typename MS, typename CHS, typename AHS>
+	inline hit_record raytracer<VB, RT, MS, CHS, AHS>::find_closest_hit(
+			const ray& ray, float max_t, float min_t) const
+	{
+		hit_record closest_hit;
 		closest_hit.t = max_t;
 
-		for (auto& aabb: acceleration_structures) {
+		for (size_t shape_id = 0; shape_id < acceleration_structures.size(); ++shape_id) {
+			auto& aabb = acceleration_structures[shape_id];
 
 			if (aabb.aabb_test(ray)){
-				for (auto& triangle: aabb.get_triangles()) {
-					payload p = intersection_shader(triangle, ray);
+				auto& triangles = aabb.get_triangles();
+				for (size_t triangle_id = 0; triangle_id < triangles.size(); ++triangle_id) {
+					payload p = intersection_shader(triangles[triangle_id], ray);
 
 					if (p.t > min_t && closest_hit.t > p.t) {
-						closest_hit = p;
-						closest_hit_triangle = &triangle;
-						anyHit = true;
-
-						if (any_hit_shader) {
-							return any_hit_shader(ray, p, triangle);
+						closest_hit.t = p.t;
+						closest_hit.bary = p.bary;
+						closest_hit.shape_id = static_cast<int>(shape_id);
+						closest_hit.triangle_id = static_cast<int>(triangle_id);
+
+						// Any hit is enough, the any hit shader ends the traversal
+						if (is_bound(any_hit_shader)) {
+							return closest_hit;
 						}
 					}
 				}
 			}
 		}
+		return closest_hit;
+	}
 
-		if (anyHit) {
-			if (closest_hit_shader) {
-				return closest_hit_shader(ray, closest_hit, *closest_hit_triangle, depth);
-			}
+	template<typename VB, typename RT, typename MS, typename CHS, typename AHS>
+	inline payload raytracer<VB, RT, MS, CHS, AHS>::shade_hit(
+			const ray& ray, const hit_record& hit, size_t depth) const
+	{
+		if (hit.shape_id < 0) {
+			return miss_shader(ray);
+		}
+
+		payload p;
+		p.t = hit.t;
+		p.bary = hit.bary;
+		auto& triangle = acceleration_structures[hit.shape_id].get_triangles()[hit.triangle_id];
+
+		if (is_bound(any_hit_shader)) {
+			return any_hit_shader(ray, p, triangle);
+		}
+		if (is_bound(closest_hit_shader)) {
+			return closest_hit_shader(ray, p, triangle, depth);
 		}
 		return miss_shader(ray);
 	}
 
-	template<typename VB, typename RT>
-	inline payload raytracer<VB, RT>::intersection_shader(
+	template<typename VB, typename RT, typename MS, typename CHS, typename AHS>
+	inline payload raytracer<VB, RT, MS, CHS, AHS>::intersection_shader(
 			const triangle<VB>& triangle, const ray& ray) const
 	{
 		payload p;
@@ -290,8 +551,8 @@ namespace cg::renderer
 		return p;
 	}
 
-	template<typename VB, typename RT>
-	float2 raytracer<VB, RT>::get_jitter(int frame_id)
+	template<typename VB, typename RT, typename MS, typename CHS, typename AHS>
+	float2 raytracer<VB, RT, MS, CHS, AHS>::get_jitter(int frame_id)
 	{
 		float2 result{0.f, 0.f};
 		constexpr int base_x = 2;
@@ -305,7 +566,7 @@ namespace cg::renderer
 			fraction *= inv_base;
 		}
 
-		constexpr int base_y = 2\3;
+		constexpr int base_y = 3;
 		index = frame_id + 1;
 		inv_base = 1.f/base_y;
 		fraction = inv_base;
@@ -1,8 +1,10 @@
 #include "raytracer_renderer.h"
 
+#include "utils/error_handler.h"
 #include "utils/resource_utils.h"
 
 #include <iostream>
+#include <random>
 
 
 void cg::renderer::ray_tracing_renderer::init()
@@ -25,6 +27,11 @@ void cg::renderer::ray_tracing_renderer::init()
 	camera->set_z_near(settings->camera_z_near);
 	camera->set_z_far(settings->camera_z_far);
 
+	if (settings->light_sampler != "power" && settings->light_sampler != "tree") {
+		THROW_ERROR("Unknown light sampler: " + settings->light_sampler);
+	}
+	use_light_tree = settings->light_sampler == "tree";
+
 	// Create render target
 	render_target = std::make_shared<resource<unsigned_color>>(settings->width, settings->height);
 
@@ -35,48 +42,205 @@ void cg::renderer::ray_tracing_renderer::init()
 	raytracer->set_render_target(render_target);
 	raytracer->set_vertex_buffers(model->get_vertex_buffers());
 	raytracer->set_index_buffers(model->get_index_buffers());
+	raytracer->build_acceleration_structure();
+	raytracer->set_primary_hit_cache(settings->gbuffer_cache);
+	raytracer->set_temporal_reprojection(settings->temporal_reprojection, settings->temporal_history_length);
 
-	lights.push_back({
-			float3{0, 1.58f, -0.03f},
-			float3{0.78f, 0.78f, .78f}
-    });
+	// Emissive geometry lights the scene, the point light is a fallback
+	// for models without emitters
+	bool has_emissive_triangles = false;
+	for (auto& aabb: raytracer->acceleration_structures) {
+		for (auto& triangle: aabb.get_triangles()) {
+			has_emissive_triangles |= luminance(triangle.emissive) > 0.f;
+		}
+	}
+	if (!has_emissive_triangles) {
+		// Intensity of ~0.78 * pi keeps the look of the former unattenuated light at a unit distance
+		lights.push_back({
+				float3{0, 1.58f, -0.03f},
+				float3{2.45f, 2.45f, 2.45f}
+		});
+	}
+
+	// Benchmark scene: many dim lights scattered inside the model bounds
+	if (settings->synthetic_lights > 0) {
+		float3 scene_min{FLT_MAX, FLT_MAX, FLT_MAX};
+		float3 scene_max{-FLT_MAX, -FLT_MAX, -FLT_MAX};
+		for (auto& aabb: raytracer->acceleration_structures) {
+			for (auto& triangle: aabb.get_triangles()) {
+				scene_min = min(scene_min, min(triangle.a, min(triangle.b, triangle.c)));
+				scene_max = max(scene_max, max(triangle.a, max(triangle.b, triangle.c)));
+			}
+		}
+
+		std::mt19937 generator(0);
+		std::uniform_real_distribution<float> distribution(0.f, 1.f);
+		float intensity = 2.f / settings->synthetic_lights;
+		for (unsigned i = 0; i < settings->synthetic_lights; ++i) {
+			float3 position{distribution(generator), distribution(generator), distribution(generator)};
+			float3 color{distribution(generator), distribution(generator), distribution(generator)};
+			lights.push_back({scene_min + position * (scene_max - scene_min), color * intensity});
+		}
+	}
 
 	shadow_raytracer = std::make_shared<cg::renderer::raytracer<cg::vertex, cg::unsigned_color>>();
+	shadow_raytracer->acceleration_structures = raytracer->acceleration_structures;
 }
 
-void cg::renderer::ray_tracing_renderer::destroy() {}
+void cg::renderer::ray_tracing_renderer::build_light_sampler()
+{
+	emitters.clear();
+	for (auto& light: lights) {
+		emitters.push_back(emitter::from_light(light));
+	}
+	for (auto& aabb: raytracer->acceleration_structures) {
+		for (auto& triangle: aabb.get_triangles()) {
+			if (luminance(triangle.emissive) > 0.f) {
+				emitters.push_back(emitter::from_triangle(triangle));
+			}
+		}
+	}
+
+	std::vector<float> powers;
+	powers.reserve(emitters.size());
+	for (auto& emitter: emitters) {
+		powers.push_back(emitter.power());
+	}
+	emitter_table.build(powers);
+	emitter_tree.build(emitters);
+}
 
-void cg::renderer::ray_tracing_renderer::update() {}
+void cg::renderer::ray_tracing_renderer::destroy()
+{
+	utils::save_resource(*render_target, settings->result_path);
+}
+
+void cg::renderer::ray_tracing_renderer::update()
+{
+	if (settings->camera_strafe != 0.f) {
+		move_right(settings->camera_strafe);
+	}
+
+	float angle = settings->light_orbit * pi / 180.f;
+	if (angle == 0.f) {
+		return;
+	}
+	for (auto& light: lights) {
+		light.position = float3{
+				light.position.x * std::cos(angle) + light.position.z * std::sin(angle),
+				light.position.y,
+				-light.position.x * std::sin(angle) + light.position.z * std::cos(angle)};
+	}
+}
 
 void cg::renderer::ray_tracing_renderer::render()
 {
 	raytracer->clear_render_target({55, 55, 55});
-	raytracer->build_acceleration_structure();
-	shadow_raytracer->acceleration_structures = raytracer->acceleration_structures;
+	build_light_sampler();
+	bind_shaders();
 
-	raytracer->closest_hit_shader = [&](const ray& ray, payload& payload, const triangle<cg::vertex>& triangle, size_t depth){
-		auto position = ray.position + ray.direction * payload.t;
-		auto normal = normalize(payload.bary.x * triangle.na + payload.bary.y * triangle.nb + payload.bary.z * triangle.nc);
-		float3 result_color {.0f, .0f, .0f};
+	auto start = std::chrono::high_resolution_clock::now();
 
-		for (auto& light: lights) {
-			cg::renderer::ray to_light(position, light.position - position);
-			auto shadow_payload = shadow_raytracer->trace_ray(to_light, 1, length(light.position - position));
-			if (shadow_payload.t < 0.f){
-				result_color += triangle.diffuse * light.color * std::max(dot(normal, to_light.direction), .0f);
-			} else {
+	raytracer->ray_generation(
+			camera->get_position(), camera->get_direction(), camera->get_right(), camera->get_up(),
+			settings->raytracing_depth, settings->accumulation_num);
 
-			}
+	auto stop = std::chrono::high_resolution_clock::now();
+	std::chrono::duration<float, std::milli> duration = stop - start;
+	std::cout << duration.count() << " ms" << std::endl;
+}
+
+cg::color cg::renderer::ray_tracing_renderer::shade_surface(
+		const ray& ray, const float3& position, float3 normal,
+		const float3& diffuse, const float3& emissive, size_t depth) const
+{
+	if (dot(normal, ray.direction) > 0.f) {
+		normal = -normal;
+	}
+	float3 result_color{.0f, .0f, .0f};
+
+	// Emitters reached by a bounce are already accounted for by the next
+	// event estimation at the previous vertex
+	bool next_event_estimation = !emitters.empty() && settings->light_samples > 0;
+	if (ray.bounce == 0 || !next_event_estimation) {
+		result_color += emissive;
+	}
+
+	// Next event estimation: a fixed number of shadow rays towards
+	// emitters picked proportionally to their power or, with the light
+	// tree, to their estimated contribution to this point
+	float3 direct_light{.0f, .0f, .0f};
+	for (unsigned sample_id = 0; next_event_estimation && sample_id < settings->light_samples; ++sample_id) {
+		float selection_pdf;
+		int emitter_id = use_light_tree
+								 ? emitter_tree.sample(position, normal, random_float(), selection_pdf)
+								 : static_cast<int>(emitter_table.sample(random_float(), selection_pdf));
+		if (emitter_id < 0) {
+			continue;
+		}
+		auto& emitter = emitters[emitter_id];
+		auto light_sample = emitter.sample(position, float2{random_float(), random_float()});
+
+		float cos_surface = dot(normal, light_sample.direction);
+		if (cos_surface <= 0.f || luminance(light_sample.incident) <= 0.f) {
+			continue;
+		}
+
+		cg::renderer::ray to_light(position, light_sample.direction);
+		auto shadow_payload = shadow_raytracer->trace_ray(to_light, 1, light_sample.distance - 0.001f);
+		if (shadow_payload.t < 0.f) {
+			direct_light += diffuse / pi * light_sample.incident * (cos_surface / selection_pdf);
 		}
+	}
+	if (next_event_estimation) {
+		result_color += direct_light / static_cast<float>(settings->light_samples);
+	}
 
-		payload.color = cg::color::from_float3(result_color);
+	if (settings->path_tracing && depth > 0) {
+		// Cosine sampling of the Lambertian BRDF leaves the albedo as the weight
+		float3 weight = diffuse;
+		float3 throughput = ray.throughput * weight;
 
+		// Russian roulette: dim paths survive with a lower probability and
+		// the survivors are reweighted, which keeps the estimate unbiased
+		bool terminated = maxelem(throughput) <= 0.f;
+		if (!terminated && ray.bounce + 1 >= settings->russian_roulette_depth) {
+			float survival = std::min(maxelem(throughput), 0.95f);
+			terminated = random_float() >= survival;
+			weight /= survival;
+			throughput /= survival;
+		}
+
+		if (!terminated) {
+			cg::renderer::ray bounce(position, sample_cosine_hemisphere(normal, float2{random_float(), random_float()}));
+			bounce.throughput = throughput;
+			bounce.bounce = ray.bounce + 1;
+			auto bounce_payload = raytracer->trace_ray(bounce, depth);
+			result_color += weight * bounce_payload.color.to_float3();
+		}
+	}
+
+	return cg::color::from_float3(result_color);
+}
+
+void cg::renderer::ray_tracing_renderer::bind_shaders()
+{
+	raytracer->closest_hit_shader = [&](const ray& ray, payload& payload, const triangle<cg::vertex>& triangle, size_t depth){
+		auto position = ray.position + ray.direction * payload.t;
+		auto normal = normalize(payload.bary.x * triangle.na + payload.bary.y * triangle.nb + payload.bary.z * triangle.nc);
+		payload.color = shade_surface(ray, position, normal, triangle.diffuse, triangle.emissive, depth);
 		return payload;
 	};
 
 	raytracer->miss_shader = [](const ray& r) {
 		payload p;
 
+		// The background is only visible, it does not light the scene
+		if (r.bounce > 0) {
+			p.color = {0.f, 0.f, 0.f};
+			return p;
+		}
+
 		p.color = {
 				(r.direction.y + 1.f) / 2.f,
 				0.f,
@@ -95,16 +259,4 @@ void cg::renderer::ray_tracing_renderer::render()
 	shadow_raytracer->any_hit_shader = [](const ray& r, payload p, const triangle<cg::vertex>& t){
 		return p;
 	};
-
-	auto start = std::chrono::high_resolution_clock::now();
-
-	raytracer->ray_generation(
-			camera->get_position(), camera->get_direction(), camera->get_right(), camera->get_up(),
-			settings->raytracing_depth, settings->accumulation_num);
-
-	auto stop = std::chrono::high_resolution_clock::now();
-	std::chrono::duration<float, std::milli> duration = stop - start;
-	std::cout << duration.count() << " ms";
-
-	utils::save_resource(*render_target, settings->result_path);
-}
\ No newline at end of file
+}
@@ -15,10 +15,24 @@ namespace cg::renderer
 		virtual void render();
 
 	protected:
+		void build_light_sampler();
+		void bind_shaders();
+
+		// Color of a surface point seen by the ray: its emission, the next
+		// event estimation and, with path tracing, a bounce
+		cg::color shade_surface(
+				const ray& ray, const float3& position, float3 normal,
+				const float3& diffuse, const float3& emissive, size_t depth) const;
+
 		std::shared_ptr<cg::resource<cg::unsigned_color>> render_target;
 		std::shared_ptr<cg::renderer::raytracer<cg::vertex, cg::unsigned_color>> raytracer;
 		std::shared_ptr<cg::renderer::raytracer<cg::vertex, cg::unsigned_color>> shadow_raytracer;
 
 		std::vector<cg::renderer::light> lights;
+		std::vector<cg::renderer::emitter> emitters;
+		cg::renderer::alias_table emitter_table;
+		cg::renderer::light_tree emitter_tree;
+		// Parsed from the light_sampler setting once in init
+		bool use_light_tree = false;
 	};
 }// namespace cg::renderer
\ No newline at end of file
@@ -10,6 +10,10 @@
 #include "renderer/raytracer/raytracer_renderer.h"
 #endif
 
+#ifdef HYBRID
+#include "renderer/hybrid/hybrid_renderer.h"
+#endif
+
 #ifdef DX12
 #include "renderer/dx12/dx12_renderer.h"
 #endif
@@ -45,6 +49,11 @@ std::shared_ptr<renderer> cg::renderer::make_renderer(std::shared_ptr<cg::settin
 	renderer->set_settings(settings);
 	return renderer;
 #endif
+#ifdef HYBRID
+	auto renderer = std::make_shared<cg::renderer::hybrid_renderer>();
+	renderer->set_settings(settings);
+	return renderer;
+#endif
 #ifdef DX12
 	auto renderer = std::make_shared<cg::renderer::dx12_renderer>();
 	renderer->set_settings(settings);
@@ -22,6 +22,9 @@ namespace cg
 		const T* get_data();
 		T& item(size_t item);
 		T& item(size_t x, size_t y);
+		// Sets the items from begin to end, the range is contiguous so the
+		// fill is vectorized
+		void fill(const T& value, size_t begin, size_t end);
 
 		size_t get_size_in_bytes() const;
 		size_t get_number_of_elements() const;
@@ -61,6 +64,12 @@ namespace cg
 		return data[x + y * stride];
 	}
 
+	template<typename T>
+	inline void resource<T>::fill(const T& value, size_t begin, size_t end)
+	{
+		std::fill(data.begin() + begin, data.begin() + end, value);
+	}
+
 	template<typename T>
 	inline size_t resource<T>::get_size_in_bytes() const
 	{
@@ -101,17 +110,17 @@ namespace cg
 		static unsigned_color from_color(const color& color)
 		{
 			return unsigned_color{
-					static_cast<unsigned char>(color.r * 255),
-					static_cast<unsigned char>(color.g * 255),
-					static_cast<unsigned char>(color.b * 255)};
+					static_cast<unsigned char>(std::clamp(color.r, 0.f, 1.f) * 255),
+					static_cast<unsigned char>(std::clamp(color.g, 0.f, 1.f) * 255),
+					static_cast<unsigned char>(std::clamp(color.b, 0.f, 1.f) * 255)};
 		};
 
 		static unsigned_color from_float3(const float3& color)
 		{
 			return unsigned_color{
-					static_cast<unsigned char>(color.x * 255),
-					static_cast<unsigned char>(color.y * 255),
-					static_cast<unsigned char>(color.z * 255)};
+					static_cast<unsigned char>(std::clamp(color.x, 0.f, 1.f) * 255),
+					static_cast<unsigned char>(std::clamp(color.y, 0.f, 1.f) * 255),
+					static_cast<unsigned char>(std::clamp(color.z, 0.f, 1.f) * 255)};
 		}
 
 		float3 to_float3() const
@@ -162,9 +171,17 @@ namespace cg
 			result.nx = this->nx + other.nx;
 			result.ny = this->ny + other.ny;
 			result.nz = this->nz + other.nz;
-
-			// TODO: Add remaining parameters
-			// ----
+			result.ambient_r = this->ambient_r + other.ambient_r;
+			result.ambient_g = this->ambient_g + other.ambient_g;
+			result.ambient_b = this->ambient_b + other.ambient_b;
+			result.diffuse_r = this->diffuse_r + other.diffuse_r;
+			result.diffuse_g = this->diffuse_g + other.diffuse_g;
+			result.diffuse_b = this->diffuse_b + other.diffuse_b;
+			result.emissive_r = this->emissive_r + other.emissive_r;
+			result.emissive_g = this->emissive_g + other.emissive_g;
+			result.emissive_b = this->emissive_b + other.emissive_b;
+			result.u = this->u + other.u;
+			result.v = this->v + other.v;
 			return result;
 		}
 
@@ -177,10 +194,17 @@ namespace cg
 			result.nx = this->nx * value;
 			result.ny = this->ny * value;
 			result.nz = this->nz * value;
-
-			// TODO: Add remaining parameters
-			// ----
-
+			result.ambient_r = this->ambient_r * value;
+			result.ambient_g = this->ambient_g * value;
+			result.ambient_b = this->ambient_b * value;
+			result.diffuse_r = this->diffuse_r * value;
+			result.diffuse_g = this->diffuse_g * value;
+			result.diffuse_b = this->diffuse_b * value;
+			result.emissive_r = this->emissive_r * value;
+			result.emissive_g = this->emissive_g * value;
+			result.emissive_b = this->emissive_b * value;
+			result.u = this->u * value;
+			result.v = this->v * value;
 			return result;
 		}
 	};
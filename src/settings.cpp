@@ -25,6 +25,30 @@ std::shared_ptr<settings> cg::settings::parse_settings(int argc, char** argv)
 	add_options("result_path", "Path to resulted image", cxxopts::value<std::filesystem::path>()->default_value("result.png"));
 	add_options("raytracing_depth", "Maximum number of traces rays", cxxopts::value<unsigned>()->default_value("1"));
 	add_options("accumulation_num", "Number of accumulated frames", cxxopts::value<unsigned>()->default_value("1"));
+	add_options("light_samples", "Number of shadow rays per hit", cxxopts::value<unsigned>()->default_value("1"));
+	add_options("light_sampler", "Light selection strategy: power or tree", cxxopts::value<std::string>()->default_value("power"));
+	add_options("synthetic_lights", "Number of random point lights added to the scene", cxxopts::value<unsigned>()->default_value("0"));
+	add_options("path_tracing", "Trace diffuse bounces up to raytracing_depth", cxxopts::value<bool>()->default_value("false"));
+	add_options("russian_roulette_depth", "Number of bounces before paths can be terminated by Russian roulette", cxxopts::value<unsigned>()->default_value("3"));
+	add_options("gbuffer_cache", "Reuse one primary hit per pixel while the camera does not move, accumulation frames are not jittered then", cxxopts::value<bool>()->default_value("false"));
+	add_options("frames", "Number of rendered frames", cxxopts::value<unsigned>()->default_value("1"));
+	add_options("light_orbit", "Rotation of point lights around the vertical axis per frame in degrees", cxxopts::value<float>()->default_value("0.0"));
+	add_options("temporal_reprojection", "Reproject accumulated samples when the camera moves", cxxopts::value<bool>()->default_value("false"));
+	add_options("temporal_history_length", "Maximum number of samples in the temporal history", cxxopts::value<unsigned>()->default_value("64"));
+	add_options("camera_strafe", "Camera movement to the right per frame", cxxopts::value<float>()->default_value("0.0"));
+	add_options("deferred_shading", "Rasterize a visibility buffer first and shade every pixel once", cxxopts::value<bool>()->default_value("false"));
+	add_options("depth_prepass", "Draw the depth first, then shade with the equal depth test", cxxopts::value<bool>()->default_value("false"));
+	add_options("front_to_back", "Sort shapes and triangle clusters front to back every frame", cxxopts::value<bool>()->default_value("false"));
+	add_options("msaa", "4x multisampling in the rasterizer, ignored with deferred shading", cxxopts::value<bool>()->default_value("false"));
+	add_options("occlusion_culling", "Draw the large shapes first and skip the shapes hidden behind them", cxxopts::value<bool>()->default_value("false"));
+	add_options("tile_buffers", "Rasterize every tile into buffers of the tile size, written to the targets once per tile", cxxopts::value<bool>()->default_value("false"));
+	add_options("pipelined", "Overlap the vertex stage of a draw call with the rasterization of the previous ones", cxxopts::value<bool>()->default_value("false"));
+	add_options("shading_rate", "Pixel shading rate of the rasterizer: 1x1, 2x2 or 4x4", cxxopts::value<std::string>()->default_value("1x1"));
+	add_options("flat_shape_shading", "Shade the shapes with a single material and normal at 4x4", cxxopts::value<bool>()->default_value("false"));
+	add_options("adaptive_shading", "Shade the blocks of 8 x 8 pixels at 4x4 or 2x2 if they were flat in the previous frame", cxxopts::value<bool>()->default_value("false"));
+	add_options("shadows", "Light the rasterized scene with a shadow map rendered from the light", cxxopts::value<bool>()->default_value("false"));
+	add_options("shadow_map_size", "Width and height of the shadow map", cxxopts::value<unsigned>()->default_value("1024"));
+	add_options("pcf_radius", "Texels around the lookup filtered on each side in the shadow map", cxxopts::value<unsigned>()->default_value("1"));
 	add_options("h,help", "Print usage");
 
 	auto result = options.parse(argc, argv);
@@ -46,6 +70,30 @@ std::shared_ptr<settings> cg::settings::parse_settings(int argc, char** argv)
 	settings->result_path = result["result_path"].as<std::filesystem::path>();
 	settings->raytracing_depth = result["raytracing_depth"].as<unsigned>();
 	settings->accumulation_num = result["accumulation_num"].as<unsigned>();
+	settings->light_samples = result["light_samples"].as<unsigned>();
+	settings->light_sampler = result["light_sampler"].as<std::string>();
+	settings->synthetic_lights = result["synthetic_lights"].as<unsigned>();
+	settings->path_tracing = result["path_tracing"].as<bool>();
+	settings->russian_roulette_depth = result["russian_roulette_depth"].as<unsigned>();
+	settings->gbuffer_cache = result["gbuffer_cache"].as<bool>();
+	settings->frames = result["frames"].as<unsigned>();
+	settings->light_orbit = result["light_orbit"].as<float>();
+	settings->temporal_reprojection = result["temporal_reprojection"].as<bool>();
+	settings->temporal_history_length = result["temporal_history_length"].as<unsigned>();
+	settings->camera_strafe = result["camera_strafe"].as<float>();
+	settings->deferred_shading = result["deferred_shading"].as<bool>();
+	settings->depth_prepass = result["depth_prepass"].as<bool>();
+	settings->front_to_back = result["front_to_back"].as<bool>();
+	settings->msaa = result["msaa"].as<bool>();
+	settings->occlusion_culling = result["occlusion_culling"].as<bool>();
+	settings->tile_buffers = result["tile_buffers"].as<bool>();
+	settings->pipelined = result["pipelined"].as<bool>();
+	settings->shading_rate = result["shading_rate"].as<std::string>();
+	settings->flat_shape_shading = result["flat_shape_shading"].as<bool>();
+	settings->adaptive_shading = result["adaptive_shading"].as<bool>();
+	settings->shadows = result["shadows"].as<bool>();
+	settings->shadow_map_size = result["shadow_map_size"].as<unsigned>();
+	settings->pcf_radius = result["pcf_radius"].as<unsigned>();
 
 	return settings;
 }
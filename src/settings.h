@@ -27,6 +27,30 @@ namespace cg
 
 		unsigned raytracing_depth;
 		unsigned accumulation_num;
+		unsigned light_samples;
+		std::string light_sampler;
+		unsigned synthetic_lights;
+		bool path_tracing;
+		unsigned russian_roulette_depth;
+		bool gbuffer_cache;
+		unsigned frames;
+		float light_orbit;
+		bool temporal_reprojection;
+		unsigned temporal_history_length;
+		float camera_strafe;
+		bool deferred_shading;
+		bool depth_prepass;
+		bool front_to_back;
+		bool msaa;
+		bool occlusion_culling;
+		bool tile_buffers;
+		bool pipelined;
+		std::string shading_rate;
+		bool flat_shape_shading;
+		bool adaptive_shading;
+		bool shadows;
+		unsigned shadow_map_size;
+		unsigned pcf_radius;
 	};
 
 }// namespace cg
\ No newline at end of file